@@ -1,22 +1,36 @@
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
-
-#define _DEFAULT_SOURCE
-#define _BSD_SOURCE
-#define _GNU_SOURCE
-
-#define ABUF_INIT {NULL, 0}
+#define ABUF_INIT {NULL, 0, 0}
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
@@ -24,17 +38,116 @@
 #define KAI_VERSION "0.0.1"
 #define KAI_TAB_STOP 4
 #define KAI_QUIT_TIMES 3
+#define KAI_HL_SLICE 1024
+#define KAI_HL_PARALLEL (1 << 14)
+#define KAI_HL_THREADS 64
+#define KAI_DIFF_GAP 8
+#define KAI_SEARCH_CHUNK 65536
+#define KAI_SEARCH_THREADS 8
+#define KAI_REGEX_STATES 1024
+#define KAI_REGEX_EOL 256
+#define KAI_SAVE_IOV 1024
+#define KAI_INPUT_BUF 4096
+#define KAI_ESC_TIMEOUT 100
+#define KAI_PROGRESS_MS 100
+#define KAI_PASTE_TIMEOUT 1000
+#define KAI_FOLLOW_BLOCK (1 << 16)
+#define KAI_FOLLOW_MAPS 64
+#define KAI_STREAM_BLOCK (1 << 20)
+#define KAI_LOAD_CHUNK (1 << 22)
+#define KAI_LONG_ROW 4096
+#define KAI_LONG_CHUNK 4096
+#define KAI_HL_LOOKAHEAD 64
+#define KAI_SLAB_CLASSES 17
+#define KAI_SLAB_MAX 4096
+#define KAI_SLAB_CHUNK (1 << 20)
+#define HL_RUN_MAX 4095
+#define KAI_UNDO_LIMIT (1 << 24)
+#define ATTR_DEFAULT 39
+#define ATTR_INVERSE 0x80
+#define ROWTREE_LEAF 256
+#define ROWTREE_FANOUT 32
 
 typedef struct erow {
-    int idx;
+    struct rownode *leaf;
     int size;
     int rsize;
     char *chars;
-    unsigned char *hl;
+    // Highlight of the render as a count followed by runs of one
+    // class, see editorHlEncode
+    uint16_t *hl;
     char *render;
+    int hl_start;
     int hl_open_comment;
+    // Chars point into the file mapping or a slab chunk they were
+    // loaded into, and are copied to a block of their own when edited
+    unsigned char mapped;
+    // Render is the chars themselves, which have no tabs to expand
+    unsigned char shared;
+    // Save whose snapshot holds the chars, see editorRowHeld
+    int snap;
+    // Gap and render window of a long row, NULL for other rows
+    struct longRow *lr;
 } erow;
 
+struct longRow {
+    // Start and length of the gap in chars, a closed gap has no length
+    int gap;
+    int gaplen;
+    // Capacity of chars, 0 while they are mapped
+    int cap;
+    // Render column held by render[0], and the render width of the
+    // row, INT_MAX if it wasn't rendered to the end
+    int roff;
+    int rwidth;
+    // Checkpoints about every KAI_LONG_CHUNK bytes from the row start
+    // to as far as it was scanned, the last one is at the row end once
+    // the whole row has been
+    struct longMark *marks;
+    int nmarks, capmarks;
+    // Size at the last scan, the lowest index edited since and the
+    // length of the tail no edit has touched since
+    int scan_size;
+    int edit_lo;
+    int edit_tail;
+};
+
+struct hlState {
+    int in_comment;
+    // Quote of the open string, 0 outside strings
+    int in_string;
+    int prev_sep;
+    // A single line comment runs to the end of the row
+    int line_comment;
+    // Bytes of the next span already highlighted, and their class
+    int skip;
+    unsigned char skip_hl;
+    // Class of the last byte highlighted
+    unsigned char prev_hl;
+};
+
+struct hlScratch {
+    // Render and highlight of a row worked out without keeping them
+    char *render;
+    unsigned char *hl;
+    int cap;
+};
+
+struct hlWorker {
+    // Run of rows a highlight thread works out the states of
+    struct erow *first;
+    int n;
+    pthread_t thread;
+};
+
+struct longMark {
+    // Index into chars and its render column
+    int cx;
+    int rx;
+    // Highlight state the row carries on from there
+    struct hlState st;
+};
+
 enum editorKey {
     BACKSPACE = 127,
     ARROW_LEFT = 1000,
@@ -45,7 +158,36 @@ enum editorKey {
     END_KEY,
     DEL_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_START
+};
+
+enum regexOp {
+    RE_CHAR,
+    RE_BOL,
+    RE_EOL,
+    RE_SPLIT,
+    RE_JMP,
+    RE_MATCH
+};
+
+enum regexNodeType {
+    RN_CLASS,
+    RN_BOL,
+    RN_EOL,
+    RN_EMPTY,
+    RN_CAT,
+    RN_ALT,
+    RN_STAR,
+    RN_PLUS,
+    RN_QUEST
+};
+
+enum undoType {
+    UNDO_INSERT,
+    UNDO_DELETE,
+    UNDO_ROWS_INSERT,
+    UNDO_ROWS_DELETE
 };
 
 enum editorHighlight {
@@ -59,9 +201,277 @@ enum editorHighlight {
     HL_MATCH
 };
 
+typedef struct rownode {
+    struct rownode *parent;
+    int leaf;
+    // Rows held by a leaf or children held by an inner node
+    int n;
+    // Rows in the whole subtree
+    int count;
+    union {
+        struct rownode **child;
+        erow *rows;
+    };
+    // Neighbouring leaves in row order
+    struct rownode *prev, *next;
+} rownode;
+
+typedef struct rowtree {
+    rownode *root;
+} rowtree;
+
 struct abuf {
     char *b;
     int len;
+    int cap;
+};
+
+struct sgrCode {
+    char seq[12];
+    int len;
+};
+
+struct screenFrame {
+    int rows, cols;
+    // Offsets the frame was drawn at
+    int rowoff, coloff;
+    char *chars;
+    // SGR foreground code of each cell, with ATTR_INVERSE for reverse video
+    unsigned char *attrs;
+};
+
+struct searchMatch {
+    int row;
+    int col;
+    int len;
+};
+
+struct regexInst {
+    int op;
+    int x, y;
+    int cls;
+};
+
+struct regexProg {
+    // Thompson NFA, instruction 0 is the start
+    struct regexInst *inst;
+    int n;
+    // Byte sets matched by RE_CHAR instructions, one bit per byte
+    unsigned char (*classes)[32];
+    int nclasses;
+};
+
+struct regexNode {
+    int type;
+    int l, r;
+    int cls;
+};
+
+struct regexParser {
+    const char *p;
+    struct regexNode *nodes;
+    int n;
+    struct regexProg *prog;
+};
+
+struct regexState {
+    // Next state for every byte and the end of the row, -1 if unknown
+    int trans[KAI_REGEX_EOL + 1];
+    // NFA instructions making up the state
+    int off, n;
+    int accept;
+};
+
+struct regexDFA {
+    struct regexProg *prog;
+    // Unanchored DFAs restart the NFA at every byte
+    int any;
+    struct regexState *states;
+    int nstates, cap;
+    int *sets;
+    int nsets, setcap;
+    // Open addressing table of state indices plus one, by NFA set
+    int hash[2 * KAI_REGEX_STATES];
+    // Scratch space for building the NFA set of a new state
+    int *mark, *stack, *work;
+    int gen, nwork;
+    int start[2];
+    int flushes;
+};
+
+struct searchChunk {
+    // Rows scanned by one job of the worker pool
+    struct erow *first;
+    int start, n;
+    struct searchMatch *matches;
+    int count, cap;
+    int done;
+};
+
+struct editorSearch {
+    // Query the match set was collected for
+    char *query;
+    int qlen;
+    // Horspool shift of every byte value for the query
+    int skip[256];
+    // Regular expression mode and the compiled query, NULL if invalid
+    int regex;
+    struct regexProg *prog;
+    // Matches in file order and the one the cursor is on
+    struct searchMatch *matches;
+    int count, cap;
+    int current;
+    // Chunks being scanned, the first nmerged are in the match set
+    struct searchChunk *chunks;
+    int nchunks, nmerged;
+    // Rows the scans cover, rows added behind them are scanned next
+    int scanned;
+    // Worker pool and the next chunk for it to claim, guarded by lock
+    pthread_t workers[KAI_SEARCH_THREADS];
+    int nworkers;
+    int next, busy;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+};
+
+struct rowSlab {
+    // Free blocks of each size class, linked through their first bytes
+    char *free[KAI_SLAB_CLASSES];
+    // Rest of the chunk that new blocks and loaded rows are carved from
+    char *next, *end;
+    // Blocks handed out so far, for the stats overlay
+    long allocs;
+};
+
+struct undoRecord {
+    unsigned char type;
+    // Edit step the record belongs to, steps are undone as a whole
+    int step;
+    // Row and column of the edit, or first row and row count for the
+    // row records
+    int row, col, n;
+    // Text inserted or removed, in the journal text, rows of the row
+    // records are joined by newlines
+    int off, len;
+    // Cursor before the edit, and after the step on its last record
+    int cx, cy;
+    int ax, ay;
+};
+
+struct editorUndo {
+    // Journal of edits, those before pos are applied and the rest
+    // were undone and can be redone
+    struct undoRecord *recs;
+    int nrecs, cap, pos;
+    struct abuf text;
+    // Last step and whether edits still join it
+    int step;
+    int open;
+    // Set while the journal is replayed, which logs nothing
+    int replay;
+};
+
+struct saveJob {
+    // File written to, swap files are autosaves
+    char *filename;
+    int swap;
+    // Snapshot of the text of every row
+    struct iovec *rows;
+    int numrows;
+    // Row buffers replaced or deleted while the save runs, with
+    // their capacities in iov_len
+    struct iovec *deferred;
+    int ndeferred, capdeferred;
+    // Value of E.dirty when the snapshot was taken
+    int dirty;
+    // Progress and outcome, guarded by lock
+    long long total, written;
+    int done, err;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    pthread_t thread;
+};
+
+struct loadBatch {
+    // Lines pointing into the file mapping or the loader's blocks
+    struct iovec *lines;
+    int n, cap;
+    // Bytes of input the lines were split from
+    long long bytes;
+    struct loadBatch *_Atomic next;
+};
+
+struct editorStream {
+    // Input of the loader thread, a file mapping or else fd
+    int fd;
+    char *map;
+    size_t maplen;
+    pthread_t thread;
+    // Queue of batches with one producer and one consumer: the
+    // loader links batches behind tail, the UI thread takes those
+    // behind head, which it has taken already
+    struct loadBatch *head, *tail;
+    atomic_int done, err, cancel;
+    // Bytes added as rows and when loading started
+    long long loaded;
+    struct timespec start;
+};
+
+struct editorBuffer {
+    // State of a file kept while another buffer is current, the
+    // current buffer's state lives in E, see editorViewLoad
+    int numrows;
+    rowtree rows;
+    int dirty;
+    char *map;
+    size_t maplen;
+    char *filename;
+    struct editorSyntax *syntax;
+    int hl_frontier;
+    int gaprow;
+    struct editorUndo undo;
+    int autosaved;
+    int swapped;
+    // File the buffer was opened from, a second view shares it
+    dev_t dev;
+    ino_t ino;
+    // Followed file and its watch, -1 if the buffer isn't followed,
+    // and the offset of the first line not read in whole
+    int follow_fd, follow_wd;
+    off_t follow_tail;
+    int follow_partial, follow_pending;
+    // Loader thread still reading the buffer in, if any
+    struct editorStream *stream;
+    // Views showing the buffer
+    int nviews;
+};
+
+struct editorView {
+    // Buffer shown and the cursor and scroll position in it
+    struct editorBuffer *buf;
+    int cx, cy, rx;
+    int rowoff, coloff;
+};
+
+struct rxCache {
+    // Row the last cursor to render index conversion was on, by its
+    // chars and size, -1 if none, and the result
+    char *chars;
+    int size;
+    int cx, rx;
+};
+
+struct editorStats {
+    // Stats are only taken while the overlay or the trace is on
+    int overlay;
+    FILE *trace;
+    // Start of the key being handled, once decoded and once dispatched
+    long long key_start, edit_start;
+    // Nanoseconds the last key and frame took in each stage
+    long long key_ns, edit_ns, hl_ns, draw_ns, write_ns;
+    // Bytes written for the last frame and row buffers allocated for it
+    int bytes;
+    long allocs, last_allocs;
 };
 
 struct editorConfig {
@@ -77,16 +487,97 @@ struct editorConfig {
     struct termios orig_state;
     // Editor rows
     int numrows;
-    erow *row;
+    rowtree rows;
     int dirty;
+    // Memory-mapped file the unedited rows point into
+    char *map;
+    size_t maplen;
     // Status message
     char *filename;
     char statusmsg[80];
     time_t statusmsg_time;
     // Syntax highlighting
     struct editorSyntax *syntax;
+    // Rows above the frontier have up to date highlight states
+    int hl_frontier;
+    // Row whose gap is open for editing, -1 if none is
+    int gaprow;
+    // Storage of the chars, render and highlight buffers of rows
+    struct rowSlab slab;
+    // Last cursor to render index conversion, dropped on edits
+    struct rxCache rxcache;
+    // Undo and redo journal
+    struct editorUndo undo;
+    // Frame being drawn and the last frame sent to the terminal
+    struct screenFrame frame, shadow;
+    // Incremental search in progress
+    struct editorSearch search;
+    // Save running in the background and the generation of its snapshot
+    struct saveJob *save;
+    int save_gen;
+    // Autosave interval in seconds, 0 if off, and the last autosave
+    int autosave;
+    time_t autosave_time;
+    int autosaved;
+    // Whether an autosave of this session wrote the swap file
+    int swapped;
+    // Bytes read from the terminal but not decoded into keys yet
+    char inbuf[KAI_INPUT_BUF];
+    int inlen, inpos;
+    // Self-pipe waking the event loop from signal handlers and threads
+    int wakefd[2];
+    // Inotify instance watching followed files, -1 until one is
+    int inotifyfd;
+    // Open views, the current one's state lives in the fields above
+    struct editorView *views;
+    int nviews, view;
+    // Timings of the hot paths for the overlay and the trace file
+    struct editorStats stats;
 };
 struct editorConfig E;
+// Set by the SIGWINCH handler, the window size is queried again
+volatile sig_atomic_t winch_pending;
+
+struct followMap {
+    // Mapping of a followed file, a free slot has lo at 0
+    _Atomic uintptr_t lo, hi;
+};
+// Read by the SIGBUS handler, which can't take locks
+struct followMap follow_maps[KAI_FOLLOW_MAPS];
+long follow_pagesize;
+
+struct editorKeyword {
+    char *word;
+    int len;
+    unsigned char hl;
+};
+
+struct editorKeywordTable {
+    // Perfect hash: the seed of a keyword's bucket leads to its slot
+    struct editorKeyword *slots;
+    unsigned int mask;
+    unsigned int *seeds;
+    unsigned int nbuckets;
+    int minlen, maxlen;
+};
+
+enum hlByteClass {
+    HLC_SEP = 1 << 0,
+    HLC_DIGIT = 1 << 1,
+    HLC_DOT = 1 << 2,
+    HLC_QUOTE = 1 << 3,
+    // First bytes of the comment start delimiters
+    HLC_SCS = 1 << 4,
+    HLC_MCS = 1 << 5
+};
+
+struct editorHlTable {
+    // Classes of every byte value, see enum hlByteClass
+    unsigned char cls[256];
+    // Comment delimiters, a length is 0 if the language has none
+    char *scs, *mcs, *mce;
+    int scs_len, mcs_len, mce_len;
+};
 
 struct editorSyntax {
     char *filetype;
@@ -96,6 +587,10 @@ struct editorSyntax {
     char *multiline_comment_start;
     char *multiline_comment_end;
     int flags;
+    // Compiled from keywords by editorCompileKeywords and from the
+    // rest by editorCompileSyntax
+    struct editorKeywordTable *kwtable;
+    struct editorHlTable *table;
 };
 
 char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
@@ -105,6 +600,12 @@ char *C_HL_keywords[] = {
     "int|", "long|", "double|", "float|", "char|", "unsigned|", "signed|",
     "void|", "const|", NULL
 };
+// Cell attribute of each highlight class, and the escape sequences
+// switching to each attribute with and without a reverse video
+// change, built once by editorInitColors
+unsigned char HL_ATTR[256];
+struct sgrCode SGR[2][256];
+
 struct editorSyntax HLDB[] = {
     {
         "c",
@@ -114,24 +615,450 @@ struct editorSyntax HLDB[] = {
         "/*",
         "*/",
         HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS,
+        NULL,
+        NULL,
     },
 };
 
+void die(const char *s);
+
+void abufGrow(struct abuf *ab, int len) {
+    /*
+    Makes room for len more bytes, doubling the capacity
+    so that appending stays amortised O(1)
+    */
+    if (ab->len + len <= ab->cap) return;
+
+    int cap = ab->cap ? ab->cap : 256;
+    while (cap < ab->len + len) cap *= 2;
+
+    char *new = realloc(ab->b, cap);
+    if (new == NULL) die("realloc");
+    ab->b = new;
+    ab->cap = cap;
+}
+
 void abufAppend(struct abuf *ab, const char *s, int len) {
     /*
     Appends a string to the buffer
     */
-    char *new = realloc(ab->b, ab->len + len);
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
+    abufGrow(ab, len);
+    memcpy(&ab->b[ab->len], s, len);
     ab->len += len;
 }
 
+void abufAppendRepeat(struct abuf *ab, char c, int n) {
+    /*
+    Appends a run of n copies of one character
+    */
+    if (n <= 0) return;
+    abufGrow(ab, n);
+    memset(&ab->b[ab->len], c, n);
+    ab->len += n;
+}
+
+void abufAppendSGR(struct abuf *ab, int code, int code2) {
+    /*
+    Appends the SGR sequence '\x1b[<code>m', or '\x1b[<code>;<code2>m'
+    when code2 isn't negative, formatting the codes in place
+    */
+    abufGrow(ab, 12);
+    char *p = &ab->b[ab->len];
+    *p++ = '\x1b';
+    *p++ = '[';
+
+    int codes[2] = { code, code2 };
+    for (int j = 0; j < 2 && codes[j] >= 0; j++) {
+        if (j) *p++ = ';';
+        if (codes[j] >= 100) *p++ = '0' + codes[j] / 100;
+        if (codes[j] >= 10) *p++ = '0' + codes[j] / 10 % 10;
+        *p++ = '0' + codes[j] % 10;
+    }
+    *p++ = 'm';
+    ab->len = p - ab->b;
+}
+
 void abufFree(struct abuf *ab) {
     /*
     Frees the buffer
     */
     free(ab->b);
+    ab->b = NULL;
+    ab->len = ab->cap = 0;
+}
+
+// Block sizes of the slab classes, steps of a half and a third
+// keep the space lost to rounding up under a third of a block
+const int slab_sizes[KAI_SLAB_CLASSES] = {
+    16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024,
+    1536, 2048, 3072, 4096,
+};
+
+int slabClass(int n) {
+    /*
+    Returns the smallest size class whose blocks hold n bytes
+    */
+    int lo = 0, hi = KAI_SLAB_CLASSES - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (slab_sizes[mid] < n) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+char *slabCarve(struct rowSlab *sl, int n) {
+    /*
+    Takes n fresh bytes from the current chunk, starting a new chunk
+    once it runs out. Chunks are never freed, their blocks are reused
+    */
+    if (sl->end - sl->next < n) {
+        sl->next = malloc(KAI_SLAB_CHUNK);
+        if (sl->next == NULL) die("malloc");
+        sl->end = sl->next + KAI_SLAB_CHUNK;
+    }
+    char *p = sl->next;
+    sl->next += n;
+    return p;
+}
+
+void *slabAlloc(struct rowSlab *sl, int n) {
+    /*
+    Allocates a buffer of n bytes, small buffers come from the free
+    list of their size class and larger ones from malloc
+    */
+    sl->allocs++;
+    if (n > KAI_SLAB_MAX) {
+        void *p = malloc(n);
+        if (p == NULL) die("malloc");
+        return p;
+    }
+
+    int c = slabClass(n);
+    char *p = sl->free[c];
+    if (p) {
+        memcpy(&sl->free[c], p, sizeof(char *));
+        return p;
+    }
+    // Keep blocks pointer-aligned for the free list links
+    sl->next += -(uintptr_t)sl->next & (sizeof(char *) - 1);
+    return slabCarve(sl, slab_sizes[c]);
+}
+
+void slabFree(struct rowSlab *sl, void *p, int n) {
+    /*
+    Frees a buffer allocated with a size of n bytes
+    */
+    if (p == NULL) return;
+    if (n > KAI_SLAB_MAX) {
+        free(p);
+        return;
+    }
+    int c = slabClass(n);
+    memcpy(p, &sl->free[c], sizeof(char *));
+    sl->free[c] = p;
+}
+
+void *slabRealloc(struct rowSlab *sl, void *p, int old, int n) {
+    /*
+    Resizes a buffer of old bytes to n bytes, it stays in place
+    while both sizes fall in the same size class
+    */
+    if (p && old > KAI_SLAB_MAX && n > KAI_SLAB_MAX) {
+        p = realloc(p, n);
+        if (p == NULL) die("realloc");
+        return p;
+    }
+    if (p && old <= KAI_SLAB_MAX && n <= KAI_SLAB_MAX &&
+        slabClass(old) == slabClass(n))
+        return p;
+
+    void *q = slabAlloc(sl, n);
+    if (p) memcpy(q, p, old < n ? old : n);
+    slabFree(sl, p, old);
+    return q;
+}
+
+char *slabLoad(struct rowSlab *sl, const char *s, int len) {
+    /*
+    Copies a line read from a file right behind the one before it,
+    with a newline in between like in a mapping of the file. Loaded
+    lines are never freed, their rows are mapped
+    */
+    sl->allocs++;
+    char *p = len + 1 > KAI_SLAB_CHUNK / 4 ? malloc(len + 1) : slabCarve(sl, len + 1);
+    if (p == NULL) die("malloc");
+    memcpy(p, s, len);
+    p[len] = '\n';
+    return p;
+}
+
+rownode *rowtreeNewNode(int leaf) {
+    /*
+    Allocates an empty leaf or inner node of the row tree
+    */
+    rownode *node = calloc(1, sizeof(rownode));
+    if (node == NULL) die("calloc");
+    node->leaf = leaf;
+    if (leaf) {
+        node->rows = malloc(sizeof(erow) * ROWTREE_LEAF);
+        if (node->rows == NULL) die("malloc");
+    } else {
+        node->child = malloc(sizeof(rownode *) * ROWTREE_FANOUT);
+        if (node->child == NULL) die("malloc");
+    }
+    return node;
+}
+
+void rowtreeFreeNode(rownode *node) {
+    if (node->leaf) free(node->rows);
+    else free(node->child);
+    free(node);
+}
+
+int rowtreeChildPos(rownode *node) {
+    /*
+    Returns the position of a node among its parent's children
+    */
+    int pos = 0;
+    while (node->parent->child[pos] != node) pos++;
+    return pos;
+}
+
+void rowtreeRecount(rownode *node) {
+    node->count = 0;
+    for (int j = 0; j < node->n; j++) node->count += node->child[j]->count;
+}
+
+void rowtreeAddChild(rowtree *t, rownode *node, rownode *child) {
+    /*
+    Links a freshly split off child right after node in the
+    parent, splitting full inner nodes up to the root
+    */
+    rownode *parent = node->parent;
+
+    if (parent == NULL) {
+        parent = rowtreeNewNode(0);
+        parent->child[0] = node;
+        parent->n = 1;
+        node->parent = parent;
+        t->root = parent;
+    }
+
+    int pos = rowtreeChildPos(node) + 1;
+    rownode *right = NULL;
+    rownode *target = parent;
+
+    if (parent->n == ROWTREE_FANOUT) {
+        int mid = (pos == parent->n) ? parent->n : parent->n / 2;
+
+        right = rowtreeNewNode(0);
+        right->n = parent->n - mid;
+        memcpy(right->child, &parent->child[mid], sizeof(rownode *) * right->n);
+        for (int j = 0; j < right->n; j++) right->child[j]->parent = right;
+        parent->n = mid;
+
+        if (pos >= mid) {
+            target = right;
+            pos -= mid;
+        }
+    }
+
+    memmove(&target->child[pos + 1], &target->child[pos],
+        sizeof(rownode *) * (target->n - pos));
+    target->child[pos] = child;
+    target->n++;
+    child->parent = target;
+    rowtreeRecount(parent);
+
+    if (right) {
+        rowtreeRecount(right);
+        rowtreeAddChild(t, parent, right);
+    }
+}
+
+rownode *rowtreeFind(rowtree *t, int *at) {
+    /*
+    Descends to the leaf holding row *at, or to the leaf a row
+    would be appended to when *at equals the row count, and
+    rebases *at to an offset inside that leaf
+    */
+    rownode *node = t->root;
+    while (!node->leaf) {
+        if (*at == node->count) {
+            // Appends go straight down the rightmost spine
+            node = node->child[node->n - 1];
+            *at = node->count;
+            continue;
+        }
+
+        int j;
+        for (j = 0; j < node->n - 1; j++) {
+            if (*at < node->child[j]->count) break;
+            *at -= node->child[j]->count;
+        }
+        node = node->child[j];
+    }
+    return node;
+}
+
+erow *rowtreeAt(rowtree *t, int at) {
+    /*
+    Returns the row at the given index in O(log n)
+    */
+    if (at < 0 || at >= t->root->count) return NULL;
+    rownode *leaf = rowtreeFind(t, &at);
+    return &leaf->rows[at];
+}
+
+int rowtreeIndex(erow *row) {
+    /*
+    Derives the index of a row by walking from its leaf to the root
+    */
+    rownode *node = row->leaf;
+    int idx = row - node->rows;
+
+    while (node->parent) {
+        rownode *parent = node->parent;
+        for (int j = 0; parent->child[j] != node; j++)
+            idx += parent->child[j]->count;
+        node = parent;
+    }
+    return idx;
+}
+
+erow *rowtreeNext(erow *row) {
+    rownode *leaf = row->leaf;
+    if (row + 1 < &leaf->rows[leaf->n]) return row + 1;
+    return leaf->next ? &leaf->next->rows[0] : NULL;
+}
+
+erow *rowtreePrev(erow *row) {
+    rownode *leaf = row->leaf;
+    if (row > leaf->rows) return row - 1;
+    return leaf->prev ? &leaf->prev->rows[leaf->prev->n - 1] : NULL;
+}
+
+erow *rowtreeInsertSpan(rowtree *t, int at, int n, int *got) {
+    /*
+    Opens uninitialised slots for up to n new rows from the given
+    index, as many as fit in one leaf, and returns the first with
+    their number in got. A full leaf is split in two, at the index
+    when more rows follow so that they fill the leaf it ends
+    */
+    rownode *leaf = rowtreeFind(t, &at);
+
+    if (leaf->n == ROWTREE_LEAF) {
+        rownode *right = rowtreeNewNode(1);
+        int mid = (at == leaf->n || n > 1) ? at : leaf->n / 2;
+
+        right->n = right->count = leaf->n - mid;
+        memcpy(right->rows, &leaf->rows[mid], sizeof(erow) * right->n);
+        for (int j = 0; j < right->n; j++) right->rows[j].leaf = right;
+        leaf->n = leaf->count = mid;
+
+        right->prev = leaf;
+        right->next = leaf->next;
+        if (leaf->next) leaf->next->prev = right;
+        leaf->next = right;
+        rowtreeAddChild(t, leaf, right);
+
+        if (at > mid || mid == ROWTREE_LEAF) {
+            leaf = right;
+            at -= mid;
+        }
+    }
+
+    int k = ROWTREE_LEAF - leaf->n < n ? ROWTREE_LEAF - leaf->n : n;
+    memmove(&leaf->rows[at + k], &leaf->rows[at], sizeof(erow) * (leaf->n - at));
+    leaf->n += k;
+    for (rownode *node = leaf; node; node = node->parent) node->count += k;
+
+    for (int j = at; j < at + k; j++) leaf->rows[j].leaf = leaf;
+    *got = k;
+    return &leaf->rows[at];
+}
+
+erow *rowtreeInsert(rowtree *t, int at) {
+    /*
+    Opens an uninitialised slot for a new row at the given index
+    and returns it
+    */
+    int got;
+    return rowtreeInsertSpan(t, at, 1, &got);
+}
+
+void rowtreeUnlink(rowtree *t, rownode *node) {
+    /*
+    Removes an empty node from its parent, along with any
+    inner nodes left without children
+    */
+    rownode *parent = node->parent;
+
+    if (node->leaf) {
+        if (node->prev) node->prev->next = node->next;
+        if (node->next) node->next->prev = node->prev;
+    }
+
+    if (parent == NULL) {
+        t->root = NULL;
+    } else {
+        int pos = rowtreeChildPos(node);
+        parent->n--;
+        memmove(&parent->child[pos], &parent->child[pos + 1],
+            sizeof(rownode *) * (parent->n - pos));
+        if (parent->n == 0) rowtreeUnlink(t, parent);
+    }
+    rowtreeFreeNode(node);
+}
+
+void rowtreeRemoveRange(rowtree *t, int at, int n) {
+    /*
+    Removes n rows from the given index, a leaf at a time with one
+    move of the rows behind them. Leaves that drop below a quarter
+    full are merged into their right neighbour
+    */
+    while (n > 0) {
+        int pos = at;
+        rownode *leaf = rowtreeFind(t, &pos);
+        int k = leaf->n - pos < n ? leaf->n - pos : n;
+        n -= k;
+
+        leaf->n -= k;
+        memmove(&leaf->rows[pos], &leaf->rows[pos + k], sizeof(erow) * (leaf->n - pos));
+        for (rownode *node = leaf; node; node = node->parent) node->count -= k;
+
+        rownode *next = leaf->next;
+        if (leaf->n == 0 && leaf->parent) {
+            rowtreeUnlink(t, leaf);
+        } else if (leaf->n < ROWTREE_LEAF / 4 && next && next->parent == leaf->parent &&
+                   leaf->n + next->n <= ROWTREE_LEAF / 2) {
+            memcpy(&leaf->rows[leaf->n], next->rows, sizeof(erow) * next->n);
+            for (int j = leaf->n; j < leaf->n + next->n; j++) leaf->rows[j].leaf = leaf;
+            leaf->n += next->n;
+            leaf->count = leaf->n;
+            rowtreeUnlink(t, next);
+        }
+
+        while (t->root && !t->root->leaf && t->root->n == 1) {
+            rownode *root = t->root;
+            t->root = root->child[0];
+            t->root->parent = NULL;
+            rowtreeFreeNode(root);
+        }
+        if (t->root == NULL) t->root = rowtreeNewNode(1);
+    }
+}
+
+void rowtreeRemove(rowtree *t, int at) {
+    /*
+    Removes the row at the given index
+    */
+    rowtreeRemoveRange(t, at, 1);
+}
+
+erow *editorRowAt(int at) {
+    return rowtreeAt(&E.rows, at);
 }
 
 void die(const char *s) {
@@ -144,10 +1071,67 @@ void die(const char *s) {
     exit(1);
 }
 
+long long editorStatsClock() {
+    /*
+    Returns the monotonic time in nanoseconds while stats are being
+    taken, and 0 otherwise
+    */
+    if (!E.stats.overlay && !E.stats.trace) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+long long editorStatsSince(long long start) {
+    /*
+    Returns the nanoseconds gone by since a time taken with
+    editorStatsClock, 0 if stats weren't being taken then
+    */
+    return start ? editorStatsClock() - start : 0;
+}
+
+void editorTraceSpan(const char *name, long long start, long long ns) {
+    /*
+    Logs a stage to the trace file as a complete event of the
+    Trace Event Format, which trace viewers load as it is
+    */
+    if (E.stats.trace == NULL || start == 0) return;
+    fprintf(E.stats.trace,
+        "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":1},\n",
+        name, start / 1e3, ns / 1e3);
+}
+
+void editorStatsFrame(long long start, long long drawn, int bytes) {
+    /*
+    Takes the stats of a frame that was drawn from start and built
+    by drawn, and logs them to the trace file
+    */
+    long allocs = E.slab.allocs - E.stats.last_allocs;
+    E.stats.last_allocs = E.slab.allocs;
+    if (start == 0) return;
+
+    long long end = editorStatsClock();
+    E.stats.draw_ns = drawn - start;
+    E.stats.write_ns = end - drawn;
+    E.stats.bytes = bytes;
+    E.stats.allocs = allocs;
+
+    if (E.stats.trace == NULL) return;
+    editorTraceSpan("draw", start, E.stats.draw_ns);
+    editorTraceSpan("write", drawn, E.stats.write_ns);
+    fprintf(E.stats.trace,
+        "{\"name\":\"frame\",\"ph\":\"C\",\"ts\":%.3f,\"pid\":1,\"tid\":1,"
+        "\"args\":{\"hl_us\":%.3f,\"bytes\":%d,\"allocs\":%ld}},\n",
+        start / 1e3, E.stats.hl_ns / 1e3, bytes, allocs);
+    fflush(E.stats.trace);
+}
+
 void disableRawMode() {
     /*
     Disables raw mode by restoring the original terminal state
+    and turns bracketed paste back off
     */
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_state) == -1)
         die("tcsetattr");
 }
@@ -166,6 +1150,8 @@ void enableRawMode() {
     - ISTRIP: Disables stripping of 8th bit
     - IXON: Disables software flow control
     - OPOST: Disables output processing
+    Reads never block, the event loop waits for input in poll.
+    Also asks the terminal to bracket pasted text
     */
     if (tcgetattr(STDIN_FILENO, &E.orig_state) == -1)
         die("tcgetattr");
@@ -177,40 +1163,221 @@ void enableRawMode() {
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
     raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    raw.c_cc[VTIME] = 0;
 
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         die("tcsetattr");
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-int editorReadKey() {
+void editorSyntaxAdvance(int upto);
+int editorSyntaxParallel(int from);
+int searchPoll(struct editorSearch *s);
+int searchTail(struct editorSearch *s);
+int editorSavePoll();
+void editorRefreshScreen();
+void editorResize();
+void editorFollowEvents();
+int editorFollowPoll();
+int searchBusy(struct editorSearch *s);
+int editorStreamPoll();
+
+void editorWake() {
     /*
-    Reads a single keypress from the user and returns it
+    Wakes the event loop up, safe from signal handlers and threads
     */
-    int nread;
-    char ch;
-    while ((nread = read(STDIN_FILENO, &ch, 1)) != 1) {
-        if (nread == -1 && errno != EAGAIN)
-            die("read");
+    int saved = errno;
+    if (write(E.wakefd[1], "", 1) == -1) {
+        // The pipe is full, the loop is going to wake up anyway
     }
+    errno = saved;
+}
+
+void editorHandleWinch(int sig) {
+    (void)sig;
+    winch_pending = 1;
+    editorWake();
+}
+
+int editorFillInput(int timeout, int wake) {
+    /*
+    Waits up to timeout milliseconds, or forever if negative, for
+    input on stdin, and also for the wake pipe if wake is set. Reads
+    everything available into the input buffer in one go.
+    Returns the number of bytes read
+    */
+    if (E.inpos > 0) {
+        memmove(E.inbuf, &E.inbuf[E.inpos], E.inlen - E.inpos);
+        E.inlen -= E.inpos;
+        E.inpos = 0;
+    }
+    if (E.inlen == KAI_INPUT_BUF) return 0;
+
+    struct pollfd pfd[3] = {
+        { STDIN_FILENO, POLLIN, 0 },
+        { E.wakefd[0], POLLIN, 0 },
+        { E.inotifyfd, POLLIN, 0 }
+    };
+    if (poll(pfd, wake ? 3 : 1, timeout) == -1) {
+        if (errno == EINTR) return 0;
+        die("poll");
+    }
+
+    if (wake && (pfd[1].revents & POLLIN)) {
+        char drain[64];
+        while (read(E.wakefd[0], drain, sizeof(drain)) > 0);
+    }
+    if (wake && (pfd[2].revents & POLLIN)) editorFollowEvents();
+    if (wake && winch_pending) {
+        winch_pending = 0;
+        editorResize();
+    }
+
+    if (!(pfd[0].revents & (POLLIN | POLLHUP))) return 0;
+
+    ssize_t n = read(STDIN_FILENO, &E.inbuf[E.inlen], KAI_INPUT_BUF - E.inlen);
+    if (n == -1 && errno != EAGAIN && errno != EINTR) die("read");
+    if (n == 0) {
+        // The terminal hung up, which leaves no errno for die to report
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        write(STDOUT_FILENO, "\x1b[H", 3);
+        fputs("kai: end of terminal input\n", stderr);
+        exit(1);
+    }
+    if (n <= 0) return 0;
+
+    E.inlen += n;
+    return n;
+}
+
+int editorReadByte(char *c, int timeout) {
+    /*
+    Takes the next byte of input, waiting up to timeout
+    milliseconds for it. Returns 0 if none came in
+    */
+    if (E.inpos == E.inlen && editorFillInput(timeout, 0) == 0) return 0;
+    *c = E.inbuf[E.inpos++];
+    return 1;
+}
+
+void editorReadPaste(struct abuf *ab) {
+    /*
+    Collects bracketed paste text up to the closing marker,
+    or until the terminal stops sending for a while
+    */
+    static const char marker[] = "\x1b[201~";
+    int mlen = sizeof(marker) - 1;
+    char c;
+
+    while (editorReadByte(&c, KAI_PASTE_TIMEOUT)) {
+        abufAppend(ab, &c, 1);
+        if (c == '~' && ab->len >= mlen && memcmp(&ab->b[ab->len - mlen], marker, mlen) == 0) {
+            ab->len -= mlen;
+            return;
+        }
+    }
+}
+
+int editorKeyPending() {
+    if (E.inpos < E.inlen) return 1;
+
+    struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+int editorIdleTimeout() {
+    /*
+    Returns how long the event loop may sleep before background
+    work needs it, in milliseconds, or -1 to wait for events only.
+    Search workers and finished saves wake the loop themselves
+    */
+    int timeout = -1;
+    if (E.save && !E.save->swap) timeout = KAI_PROGRESS_MS;
+
+    if (E.autosave && !E.save && E.filename && E.dirty && E.dirty != E.autosaved &&
+        !E.views[E.view].buf->stream) {
+        long due = (E.autosave_time + E.autosave - time(NULL)) * 1000;
+        if (due < 0) due = 0;
+        if (timeout == -1 || due < timeout) timeout = due;
+    }
+    return timeout;
+}
+
+void editorSyntaxSlice() {
+    /*
+    Moves the highlight frontier down by a slice of rows
+    */
+    // Rows ahead of the frontier are worked out on every processor a
+    // batch at a time, the frontier then sweeps over them a slice at a
+    // time like over any other rows. The end of the batch is only a
+    // hint, edits moving the rows cost at most a batch worked out again
+    static int ahead = 0;
+    if (E.hl_frontier >= ahead || ahead > E.numrows)
+        ahead = editorSyntaxParallel(E.hl_frontier);
+    editorSyntaxAdvance(E.hl_frontier + KAI_HL_SLICE);
+}
+
+void editorIdle() {
+    /*
+    Runs background work between keypresses: shows the matches the
+    search workers found, the progress of saves and the growth of a
+    followed file since the last call, adds the rows loaded in the
+    background, and highlights the rows
+    below the frontier a slice at a time until a key comes in
+    */
+    // Rows a followed file grew by are scanned once they are added
+    int changed = searchPoll(&E.search);
+    changed |= editorFollowPoll();
+    changed |= searchTail(&E.search);
+    changed |= editorSavePoll();
+    if (changed) editorRefreshScreen();
+
+    // Every batch of loaded rows is shown, the first screen included,
+    // and searched behind the rows a search already covers
+    while (editorStreamPoll()) {
+        searchTail(&E.search);
+        editorRefreshScreen();
+        if (editorKeyPending()) return;
+    }
+
+    while (E.syntax && E.hl_frontier < E.numrows && !editorKeyPending())
+        editorSyntaxSlice();
+}
+
+int editorReadKey() {
+    /*
+    Reads a single keypress from the user and returns it
+    */
+    char ch;
+    while (!editorReadByte(&ch, 0)) {
+        editorIdle();
+        if (!editorKeyPending()) editorFillInput(editorIdleTimeout(), 1);
+    }
+    E.stats.key_start = editorStatsClock();
 
     if (ch == '\x1b') {
         char seq[3];
-        if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+        if (!editorReadByte(&seq[0], KAI_ESC_TIMEOUT)) return '\x1b';
+        if (!editorReadByte(&seq[1], KAI_ESC_TIMEOUT)) return '\x1b';
 
         if (seq[0] == '[') {
             if (seq[1] >= '0' && seq[1] <= '9') {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+                int code = seq[1] - '0';
+                if (!editorReadByte(&seq[2], KAI_ESC_TIMEOUT)) return '\x1b';
+                while (seq[2] >= '0' && seq[2] <= '9' && code < 1000) {
+                    code = code * 10 + seq[2] - '0';
+                    if (!editorReadByte(&seq[2], KAI_ESC_TIMEOUT)) return '\x1b';
+                }
                 if (seq[2] == '~') {
-                    switch (seq[1]) {
-                        case '1': return HOME_KEY;
-                        case '3': return DEL_KEY;
-                        case '4': return END_KEY;
-                        case '5': return PAGE_UP;
-                        case '6': return PAGE_DOWN;
-                        case '7': return HOME_KEY;
-                        case '8': return END_KEY;
+                    switch (code) {
+                        case 1: return HOME_KEY;
+                        case 3: return DEL_KEY;
+                        case 4: return END_KEY;
+                        case 5: return PAGE_UP;
+                        case 6: return PAGE_DOWN;
+                        case 7: return HOME_KEY;
+                        case 8: return END_KEY;
+                        case 200: return PASTE_START;
                     }
                 }
             } else {
@@ -244,7 +1411,7 @@ int getCursorPosition(int *rows, int *cols) {
         return -1;
 
     while (i < sizeof(buf) - 1) {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1) break;
+        if (!editorReadByte(&buf[i], KAI_ESC_TIMEOUT)) break;
         if (buf[i] == 'R') break;
         i++;
     }
@@ -273,128 +1440,479 @@ int getWindowSize(int *rows, int *cols) {
     }
 }
 
-int is_separator(int c) {
-  return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+struct editorHlTable *editorCompileSyntax(struct editorSyntax *s) {
+    /*
+    Builds the byte class table of a language. Delimiters are found
+    by their first byte, so the highlighter only compares the bytes
+    that can start one
+    */
+    struct editorHlTable *t = calloc(1, sizeof(struct editorHlTable));
+    if (t == NULL) die("calloc");
+
+    for (int c = 0; c < 256; c++)
+        if (isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL)
+            t->cls[c] |= HLC_SEP;
+
+    if (s->flags & HL_HIGHLIGHT_NUMBERS) {
+        for (int c = '0'; c <= '9'; c++) t->cls[c] |= HLC_DIGIT;
+        t->cls['.'] |= HLC_DOT;
+    }
+    if (s->flags & HL_HIGHLIGHT_STRINGS) {
+        t->cls['"'] |= HLC_QUOTE;
+        t->cls['\''] |= HLC_QUOTE;
+    }
+
+    t->scs = s->singleline_comment_start;
+    t->scs_len = t->scs ? strlen(t->scs) : 0;
+    if (t->scs_len) t->cls[(unsigned char)t->scs[0]] |= HLC_SCS;
+
+    // Multiline comments need both delimiters
+    t->mcs = s->multiline_comment_start;
+    t->mce = s->multiline_comment_end;
+    if (t->mcs && t->mce && *t->mcs && *t->mce) {
+        t->mcs_len = strlen(t->mcs);
+        t->mce_len = strlen(t->mce);
+        t->cls[(unsigned char)t->mcs[0]] |= HLC_MCS;
+    }
+    return t;
 }
 
-void editorUpdateSyntax(erow *row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+unsigned int editorKeywordHash(const char *s, int len, unsigned int seed) {
+    /*
+    Seeded FNV-1a hash of a token with a final avalanche
+    */
+    unsigned int h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (int j = 0; j < len; j++) {
+        h ^= (unsigned char)s[j];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
 
-    if (E.syntax == NULL) return;
+int editorKeywordPlace(struct editorKeywordTable *kt, struct editorKeyword *words,
+                       int *bucket, int n, unsigned int seed) {
+    /*
+    Tries to give every keyword of one bucket its own free slot
+    under the given seed, and leaves the table untouched if it can't
+    */
+    int j;
+    for (j = 0; j < n; j++) {
+        struct editorKeyword *w = &words[bucket[j]];
+        struct editorKeyword *slot = &kt->slots[editorKeywordHash(w->word, w->len, seed) & kt->mask];
+        if (slot->len) break;
+        *slot = *w;
+    }
+    if (j == n) return 1;
+
+    while (j--) {
+        struct editorKeyword *w = &words[bucket[j]];
+        kt->slots[editorKeywordHash(w->word, w->len, seed) & kt->mask].len = 0;
+    }
+    return 0;
+}
+
+struct editorKeywordTable *editorCompileKeywords(char **keywords) {
+    /*
+    Builds a perfect hash table of a syntax's keywords, with the
+    lengths and the trailing '|' KEYWORD2 marker parsed up front.
+    Keywords are grouped into buckets by a first hash, and each
+    bucket, biggest first, gets the seed of a second hash that
+    sends all of its keywords to free slots
+    */
+    struct editorKeywordTable *kt = calloc(1, sizeof(*kt));
+    if (kt == NULL) die("calloc");
+    int n = 0;
+    while (keywords[n]) n++;
+
+    unsigned int size = 2;
+    while (size < (unsigned int)n * 2) size <<= 1;
+
+    // Open addressing set to drop repeated keywords, the first
+    // spelling wins as it would in a linear scan
+    int *seen = malloc(sizeof(int) * size);
+    if (seen == NULL) die("malloc");
+    memset(seen, -1, sizeof(int) * size);
+
+    struct editorKeyword *words = malloc(sizeof(*words) * (n + 1));
+    if (words == NULL) die("malloc");
+    int count = 0;
+    kt->minlen = INT_MAX;
+    for (int j = 0; j < n; j++) {
+        int len = strlen(keywords[j]);
+        int kw2 = (len > 0 && keywords[j][len - 1] == '|');
+        if (kw2) len--;
+        if (len == 0) continue;
+
+        unsigned int h = editorKeywordHash(keywords[j], len, 0) & (size - 1);
+        while (seen[h] != -1 && (words[seen[h]].len != len ||
+               memcmp(words[seen[h]].word, keywords[j], len)))
+            h = (h + 1) & (size - 1);
+        if (seen[h] != -1) continue;
+        seen[h] = count;
+
+        words[count].word = keywords[j];
+        words[count].len = len;
+        words[count].hl = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        if (len < kt->minlen) kt->minlen = len;
+        if (len > kt->maxlen) kt->maxlen = len;
+        count++;
+    }
+    free(seen);
+
+    kt->nbuckets = 1;
+    while (kt->nbuckets * 2 < (unsigned int)count) kt->nbuckets <<= 1;
+    kt->seeds = calloc(kt->nbuckets, sizeof(unsigned int));
+    if (kt->seeds == NULL) die("calloc");
+
+    // Keywords sorted by bucket, buckets sorted by size
+    int *start = calloc(kt->nbuckets + 1, sizeof(int));
+    int *order = malloc(sizeof(int) * (count + 1));
+    if (start == NULL || order == NULL) die("malloc");
+    int maxfill = 0;
+    for (int j = 0; j < count; j++)
+        start[(editorKeywordHash(words[j].word, words[j].len, 0) & (kt->nbuckets - 1)) + 1]++;
+    for (unsigned int b = 0; b < kt->nbuckets; b++) {
+        if (start[b + 1] > maxfill) maxfill = start[b + 1];
+        start[b + 1] += start[b];
+    }
+    int *fill = calloc(kt->nbuckets, sizeof(int));
+    if (fill == NULL) die("calloc");
+    for (int j = 0; j < count; j++) {
+        unsigned int b = editorKeywordHash(words[j].word, words[j].len, 0) & (kt->nbuckets - 1);
+        order[start[b] + fill[b]++] = j;
+    }
 
-    char **keywords = E.syntax->keywords;
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+    for (;; size <<= 1) {
+        kt->slots = realloc(kt->slots, sizeof(*kt->slots) * size);
+        if (kt->slots == NULL) die("realloc");
+        memset(kt->slots, 0, sizeof(*kt->slots) * size);
+        kt->mask = size - 1;
+
+        int placed = 1;
+        for (int want = maxfill; want > 0 && placed; want--) {
+            for (unsigned int b = 0; b < kt->nbuckets && placed; b++) {
+                if (fill[b] != want) continue;
+
+                unsigned int seed;
+                for (seed = 1; seed < 1u << 16; seed++)
+                    if (editorKeywordPlace(kt, words, &order[start[b]], want, seed)) break;
+                kt->seeds[b] = seed;
+                placed = (seed < 1u << 16);
+            }
+        }
+        if (placed) break;
+    }
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+    free(start);
+    free(order);
+    free(fill);
+    free(words);
+    return kt;
+}
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+int editorKeywordLookup(struct editorKeywordTable *kt, const char *s, int len) {
+    /*
+    Returns the highlight class of a token, or HL_NORMAL if
+    it isn't a keyword
+    */
+    if (len < kt->minlen || len > kt->maxlen) return HL_NORMAL;
 
-    int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+    unsigned int seed = kt->seeds[editorKeywordHash(s, len, 0) & (kt->nbuckets - 1)];
+    struct editorKeyword *slot = &kt->slots[editorKeywordHash(s, len, seed) & kt->mask];
+    if (slot->len == len && !memcmp(slot->word, s, len)) return slot->hl;
+    return HL_NORMAL;
+}
 
-        if (scs_len && !in_string && !in_comment) {
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
+void editorHighlightInit(struct hlState *st, int in_comment) {
+    /*
+    Sets up the state at the start of a row
+    */
+    memset(st, 0, sizeof(*st));
+    st->in_comment = in_comment;
+    st->prev_sep = 1;
+    st->prev_hl = HL_NORMAL;
+}
+
+void editorHighlightSpan(struct hlState *st, char *render, int len, int end,
+                         unsigned char *hl) {
+    /*
+    Highlights len rendered bytes into hl carrying on from the state
+    left by the span before them. The bytes up to end are the start
+    of the next span and may be looked at, those past it never are,
+    and hl must have room for end bytes. Each byte is dispatched on
+    its class in the language's table, comments and strings are
+    skipped over to the bytes that can end them
+    */
+    // Empty rows may have no highlight buffer at all, and leave the
+    // state as it is
+    if (len == 0) return;
+    memset(hl, HL_NORMAL, len);
+
+    if (E.syntax == NULL) return;
+
+    if (st->line_comment) {
+        memset(hl, HL_COMMENT, len);
+        return;
+    }
+    if (st->skip >= len) {
+        memset(hl, st->skip_hl, len);
+        st->skip -= len;
+        if (len) st->prev_hl = st->skip_hl;
+        return;
+    }
+
+    struct editorKeywordTable *kwtable = E.syntax->kwtable;
+    struct editorHlTable *t = E.syntax->table;
+    const unsigned char *cls = t->cls;
+
+    int prev_sep = st->prev_sep;
+    int in_string = st->in_string;
+    int in_comment = st->in_comment;
+
+    memset(hl, st->skip_hl, st->skip);
+    int i = st->skip;
+    while (i < len) {
+        if (in_comment && t->mce_len) {
+            char *p = memchr(&render[i], t->mce[0], len - i);
+            int e = p ? p - render : len;
+            memset(&hl[i], HL_MLCOMMENT, e - i);
+            i = e;
+            if (i == len) break;
+
+            if (end - i >= t->mce_len && !memcmp(&render[i], t->mce, t->mce_len)) {
+                memset(&hl[i], HL_MLCOMMENT, t->mce_len);
+                i += t->mce_len;
+                in_comment = 0;
+                prev_sep = 1;
+            } else {
+                hl[i++] = HL_MLCOMMENT;
             }
+            continue;
         }
 
-        if (mcs_len && mce_len && !in_string) {
-            if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
+        if (in_string) {
+            int e = i;
+            while (e < len && render[e] != in_string && render[e] != '\\') e++;
+            memset(&hl[i], HL_STRING, e - i);
+            i = e;
+            prev_sep = 1;
+            if (i == len) break;
+
+            hl[i] = HL_STRING;
+            if (render[i] == '\\' && i + 1 < end) {
+                hl[i + 1] = HL_STRING;
+                i += 2;
                 continue;
             }
+            if (render[i] == in_string) in_string = 0;
+            i++;
+            continue;
         }
 
+        unsigned char c = render[i];
+        int k = cls[c];
+        if (k == 0 && !prev_sep) {
+            // Plain bytes inside a token stay normal
+            i++;
+            while (i < len && cls[(unsigned char)render[i]] == 0) i++;
+            continue;
+        }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING;
-                if (c == '\\' && i + 1 < row->rsize) {
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-
-                if (c == in_string) in_string = 0;
-
-                i++;
-                prev_sep = 1;
+        if (k & (HLC_SCS | HLC_MCS | HLC_QUOTE)) {
+            if ((k & HLC_SCS) && end - i >= t->scs_len &&
+                !memcmp(&render[i], t->scs, t->scs_len)) {
+                memset(&hl[i], HL_COMMENT, len - i);
+                st->line_comment = 1;
+                break;
+            }
+            if ((k & HLC_MCS) && end - i >= t->mcs_len &&
+                !memcmp(&render[i], t->mcs, t->mcs_len)) {
+                memset(&hl[i], HL_MLCOMMENT, t->mcs_len);
+                i += t->mcs_len;
+                in_comment = 1;
+                continue;
+            }
+            if (k & HLC_QUOTE) {
+                in_string = c;
+                hl[i++] = HL_STRING;
                 continue;
-            } else {
-                if (c == '"' || c == '\'') {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
             }
         }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-                    (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
-                i++;
+        if (k & (HLC_DIGIT | HLC_DOT)) {
+            unsigned char prev_hl = (i > 0) ? hl[i - 1] : st->prev_hl;
+            if (((k & HLC_DIGIT) && prev_sep) || prev_hl == HL_NUMBER) {
+                hl[i++] = HL_NUMBER;
                 prev_sep = 0;
                 continue;
             }
         }
 
         if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-
-                if (kw2) klen--;
-
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                    is_separator(row->render[i + klen])) {
-                        memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                        i += klen;
-                        break;
-                }
-            }
+            int klen = 0;
+            while (i + klen < end && !(cls[(unsigned char)render[i + klen]] & HLC_SEP)) klen++;
 
-            if (keywords[j] != NULL) {
+            int kw = editorKeywordLookup(kwtable, &render[i], klen);
+            if (kw != HL_NORMAL) {
+                memset(&hl[i], kw, klen);
+                i += klen;
                 prev_sep = 0;
                 continue;
             }
         }
 
-        prev_sep = is_separator(c);
+        prev_sep = k & HLC_SEP;
         i++;
     }
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+    st->in_comment = in_comment;
+    st->in_string = in_string;
+    st->prev_sep = prev_sep;
+    st->skip = i > len ? i - len : 0;
+    if (st->skip) st->skip_hl = hl[len];
+    if (len) st->prev_hl = hl[len - 1];
+}
+
+int editorHighlightLine(char *render, int rsize, unsigned char *hl, int in_comment) {
+    /*
+    Highlights one rendered line into hl, starting
+    inside a multiline comment if in_comment is set, and returns
+    whether the line ends inside one
+    */
+    struct hlState st;
+    editorHighlightInit(&st, in_comment);
+    editorHighlightSpan(&st, render, rsize, rsize, hl);
+    return E.syntax ? st.in_comment : 0;
+}
+
+int editorHlRuns(const unsigned char *hl, int len) {
+    /*
+    Counts the runs an encoding of len highlight bytes takes
+    */
+    int n = 0;
+    for (int j = 0; j < len; n++) {
+        int k = j + 1;
+        while (k < len && k - j < HL_RUN_MAX && hl[k] == hl[j]) k++;
+        j = k;
+    }
+    return n;
+}
+
+void editorHlEncode(const unsigned char *hl, int len, uint16_t *runs) {
+    /*
+    Encodes len highlight bytes as runs[0] runs following it, each
+    holding a class in its top 4 bits and a length of up to
+    HL_RUN_MAX bytes below them
+    */
+    int n = 0;
+    for (int j = 0; j < len;) {
+        int k = j + 1;
+        while (k < len && k - j < HL_RUN_MAX && hl[k] == hl[j]) k++;
+        runs[++n] = hl[j] << 12 | (k - j);
+        j = k;
+    }
+    runs[0] = n;
+}
+
+void editorHlDecode(const uint16_t *runs, unsigned char *hl) {
+    /*
+    Expands runs back into one highlight byte per rendered byte
+    */
+    for (int r = 1; r <= runs[0]; r++) {
+        int len = runs[r] & HL_RUN_MAX;
+        memset(hl, runs[r] >> 12, len);
+        hl += len;
+    }
+}
+
+void editorHlFree(uint16_t *hl, int lr) {
+    /*
+    Frees highlight runs, those of long rows come from malloc and
+    those of short rows are slab blocks sized by their run count
+    */
+    if (hl == NULL) return;
+    if (lr) free(hl);
+    else slabFree(&E.slab, hl, (hl[0] + 1) * sizeof(uint16_t));
+}
+
+void editorRowFreeHl(erow *row, uint16_t *hl) {
+    /*
+    Frees highlight runs of a row
+    */
+    editorHlFree(hl, row->lr != NULL);
+}
+
+void editorRowSetHl(erow *row, const unsigned char *hl, int len) {
+    /*
+    Replaces the highlight of a row with the runs of len bytes
+    */
+    int n = editorHlRuns(hl, len);
+    int cap = (n + 1) * sizeof(uint16_t);
+    if (row->lr) {
+        row->hl = realloc(row->hl, cap);
+        if (row->hl == NULL) die("realloc");
+    } else {
+        int old = row->hl ? (row->hl[0] + 1) * sizeof(uint16_t) : 0;
+        row->hl = slabRealloc(&E.slab, row->hl, old, cap);
+    }
+    editorHlEncode(hl, len, row->hl);
+}
+
+unsigned char *editorHlScratch(int len) {
+    /*
+    Returns a scratch buffer for len highlight bytes, rows are
+    highlighted into it before being encoded as runs
+    */
+    static unsigned char *hl = NULL;
+    static int cap = 0;
+    if (len > cap) {
+        cap = len;
+        hl = realloc(hl, cap);
+        if (hl == NULL) die("realloc");
+    }
+    return hl;
+}
+
+int editorRowHighlight(erow *row, int in_comment) {
+    /*
+    Highlights the render of a short row into its runs, and returns
+    whether it ends inside a multiline comment
+    */
+    unsigned char *hl = editorHlScratch(row->rsize);
+    int state = editorHighlightLine(row->render, row->rsize, hl, in_comment);
+    editorRowSetHl(row, hl, row->rsize);
+    return state;
+}
+
+void editorSyntaxInvalidate(int at) {
+    /*
+    Moves the highlight frontier back to a row whose start
+    state may no longer match the end state of the row above
+    */
+    if (at < E.hl_frontier) E.hl_frontier = at;
+}
+
+int editorRowLong(erow *row);
+int editorLongRowScan(erow *row, int in_comment, int build);
+
+void editorUpdateSyntax(erow *row) {
+    /*
+    Re-highlights a row from the end state of the row above,
+    rows further down are left to editorSyntaxAdvance
+    */
+    erow *prev = rowtreePrev(row);
+    row->hl_start = prev ? prev->hl_open_comment : 0;
+    if (editorRowLong(row))
+        row->hl_open_comment = editorLongRowScan(row, row->hl_start, 1);
+    else
+        row->hl_open_comment = editorRowHighlight(row, row->hl_start);
+
+    erow *next = rowtreeNext(row);
+    if (next && next->hl_start != row->hl_open_comment)
+        editorSyntaxInvalidate(rowtreeIndex(row) + 1);
 }
 
 int editorSyntaxToColor(int hl) {
@@ -417,6 +1935,30 @@ int editorSyntaxToColor(int hl) {
     }
 }
 
+void editorInitColors() {
+    /*
+    Builds the highlight class to cell attribute table and the
+    escape sequence of every cell attribute
+    */
+    for (int hl = 0; hl < 256; hl++)
+        HL_ATTR[hl] = (hl == HL_NORMAL) ? ATTR_DEFAULT : editorSyntaxToColor(hl);
+
+    struct abuf ab = ABUF_INIT;
+    for (int attr = 0; attr < 256; attr++) {
+        for (int full = 0; full < 2; full++) {
+            ab.len = 0;
+            if (full)
+                abufAppendSGR(&ab, (attr & ATTR_INVERSE) ? 7 : 27, attr & ~ATTR_INVERSE);
+            else
+                abufAppendSGR(&ab, attr, -1);
+
+            memcpy(SGR[full][attr].seq, ab.b, ab.len);
+            SGR[full][attr].len = ab.len;
+        }
+    }
+    abufFree(&ab);
+}
+
 void editorSelectSyntaxHighlight() {
     E.syntax = NULL;
     if (E.filename == NULL) return;
@@ -432,10 +1974,16 @@ void editorSelectSyntaxHighlight() {
             if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
                 (!is_ext && strstr(E.filename, s->filematch[i]))) {
                     E.syntax = s;
+                    if (s->kwtable == NULL) {
+                        s->kwtable = editorCompileKeywords(s->keywords);
+                        s->table = editorCompileSyntax(s);
+                    }
 
-                    for (int filerow = 0; filerow < E.numrows; filerow++) {
-                        editorUpdateSyntax(&E.row[filerow]);
+                    for (erow *row = editorRowAt(0); row; row = rowtreeNext(row)) {
+                        row->hl_start = -1;
+                        if (row->lr) row->lr->nmarks = 0;
                     }
+                    E.hl_frontier = 0;
                     return;
             }
 
@@ -444,579 +1992,3755 @@ void editorSelectSyntaxHighlight() {
     }
 }
 
-int editorRowCxToRx(erow *row, int cx) {
+int editorRowLong(erow *row) {
     /*
-    Converts the cursor index to the render index
+    Returns whether a row is edited through a gap and rendered
+    through a window of columns, rows stay long once they are
     */
-    int rx = 0;
-    for (int j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t')
-        rx += (KAI_TAB_STOP - 1) - (rx % KAI_TAB_STOP);
-        rx++;
-    }
-    return rx;
+    return row->lr || row->size >= KAI_LONG_ROW;
 }
 
-int editorRowRxToCx(erow *row, int rx) {
+char *editorRowSegment(erow *row, int at, int *len) {
     /*
-    Converts the render index to the cursor index
+    Returns where the chars from index at are stored, and in len how
+    many of them are contiguous there, up to the gap or the row end
     */
-    int cur_rx = 0;
-    int cx;
-
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t')
-            cur_rx += (KAI_TAB_STOP - 1) - (cur_rx % KAI_TAB_STOP);
-
-        cur_rx++;
-        if (cur_rx > rx) return cx;
+    struct longRow *lr = row->lr;
+    if (lr == NULL || lr->gaplen == 0 || at >= lr->gap) {
+        *len = row->size - at;
+        return &row->chars[at + (lr && at >= lr->gap ? lr->gaplen : 0)];
     }
-    return cx;
+    *len = lr->gap - at;
+    return &row->chars[at];
 }
 
-void editorUpdateRow(erow *row) {
+int editorRowCap(erow *row) {
     /*
-    Updates the row by converting tabs to spaces
+    Returns the size the chars of a heap row were allocated with,
+    short rows are kept in a block that just fits them
     */
-    int tabs = 0;
-    int j;
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t') tabs++;
+    return row->lr ? row->lr->cap : row->size + 1;
+}
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (KAI_TAB_STOP - 1) + 1);
+void editorRowDropRender(erow *row) {
+    /*
+    Frees the render and highlight buffers of a row. The render of a
+    short row is a slab block sized by rsize, a long row's is malloc'd
+    for its window
+    */
+    editorRowFreeHl(row, row->hl);
+    if (row->lr) free(row->render);
+    else if (!row->shared) slabFree(&E.slab, row->render, row->rsize + 1);
+    row->render = NULL;
+    row->hl = NULL;
+    row->rsize = 0;
+    row->shared = 0;
+}
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            
-            while (idx % KAI_TAB_STOP != 0) row->render[idx++] = ' ';
-        } else {
-            row->render[idx++] = row->chars[j];
-        }
+struct longRow *editorLongRowInit(erow *row) {
+    /*
+    Returns the long row data of a row, set up the first time
+    */
+    if (row->lr == NULL) {
+        editorRowDropRender(row);
+        row->lr = calloc(1, sizeof(struct longRow));
+        if (row->lr == NULL) die("calloc");
+        row->lr->rwidth = INT_MAX;
+        row->lr->cap = row->mapped ? 0 : row->size + 1;
     }
+    return row->lr;
+}
 
-    row->render[idx] = '\0';
-    row->rsize = idx;
-
-    editorUpdateSyntax(row);
+void editorLongRowFree(struct longRow *lr) {
+    if (lr) free(lr->marks);
+    free(lr);
 }
 
-void editorInsertRow(int at, char *s, size_t len) {
+void editorLongRowEdit(erow *row, int at, int tail) {
     /*
-    Inserts a row into the editor
+    Records an edit of a long row at index at which left its last
+    tail bytes alone. The checkpoints before it stay good, those in
+    the untouched tail are caught up with by the next scan
     */
-    if (at < 0 || at > E.numrows) return;
-
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    for (int j = at + 1; j <= E.numrows; j++) E.row[j].idx++;
-
-
-    E.row[at].idx = at;
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
-
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
-    E.numrows++;
-    E.dirty++;
+    struct longRow *lr = row->lr;
+    if (lr == NULL) return;
+    if (at < lr->edit_lo) lr->edit_lo = at;
+    if (tail < lr->edit_tail) lr->edit_tail = tail;
 }
 
-void editorFreeRow(erow *row) {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+int editorLongMarkAt(struct longRow *lr, int cx) {
+    /*
+    Returns the last checkpoint at or before index cx
+    */
+    int lo = 0, hi = lr->nmarks - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (lr->marks[mid].cx <= cx) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
 }
 
-void editorDelRow(int at) {
+int editorLongMarkRx(struct longRow *lr, int rx, int cx) {
     /*
-    Deletes a row from the editor
+    Returns the last checkpoint at or before render column rx,
+    among those at or before index cx
     */
-    if (at < 0 || at >= E.numrows) return;
-    free(E.row[at].chars);
-    free(E.row[at].render);
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    for (int j = at; j < E.numrows - 1; j++) E.row[j].idx--;
-
-    E.numrows--;
-    E.dirty++;
+    int lo = 0, hi = editorLongMarkAt(lr, cx);
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (lr->marks[mid].rx <= rx) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
 }
 
-void editorRowInsertChar(erow *row, int at, int c) {
-    if (at < 0 || at > row->size) at = row->size;
-
-    row->chars = realloc(row->chars, row->size + 2);
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-
-    editorUpdateRow(row);
-    E.dirty++;
+int simdHasAvx2() {
+    /*
+    Returns whether the CPU runs AVX2, asked once
+    */
+#if defined(__SSE2__) && defined(__GNUC__)
+    static int has = -1;
+    if (has == -1) has = __builtin_cpu_supports("avx2") ? 1 : 0;
+    return has;
+#else
+    return 0;
+#endif
 }
 
-void editorRowAppendString(erow *row, char *s, size_t len) {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+#if defined(__SSE2__) && defined(__GNUC__)
+__attribute__((target("avx2")))
+int simdCountByteAvx2(const char *s, int n, char c) {
+    /*
+    Counts the bytes equal to c in the first n & ~31 bytes of s
+    */
+    __m256i t = _mm256_set1_epi8(c);
+    int count = 0;
+    for (int j = 0; j + 32 <= n; j += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + j));
+        count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, t)));
+    }
+    return count;
 }
 
-void editorRowDelChar(erow *row, int at) {
-    if (at < 0 || at >= row->size) return;
+__attribute__((target("avx2")))
+int simdFindCntrlAvx2(const char *s, int n) {
+    /*
+    Returns the index of the first control character in the first
+    n & ~31 bytes of s, or n & ~31 if there is none
+    */
+    __m256i lim = _mm256_set1_epi8(31), del = _mm256_set1_epi8(127);
+    int j = 0;
+    for (; j + 32 <= n; j += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + j));
+        __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, lim), v),
+                                    _mm256_cmpeq_epi8(v, del));
+        unsigned int bits = _mm256_movemask_epi8(m);
+        if (bits) return j + __builtin_ctz(bits);
+    }
+    return j;
+}
+#endif
 
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+int simdCountByte(const char *s, int n, char c) {
+    /*
+    Counts the bytes of s equal to c, 16 or 32 at a time
+    */
+    int count = 0, j = 0;
+#if defined(__SSE2__) && defined(__GNUC__)
+    if (n >= 64 && simdHasAvx2()) {
+        count = simdCountByteAvx2(s, n, c);
+        j = n & ~31;
+    }
+    __m128i t = _mm_set1_epi8(c);
+    for (; j + 16 <= n; j += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + j));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, t)));
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    uint8x16_t t = vdupq_n_u8(c), one = vdupq_n_u8(1);
+    for (; j + 16 <= n; j += 16)
+        count += vaddvq_u8(vandq_u8(vceqq_u8(vld1q_u8((const uint8_t *)(s + j)), t), one));
+#endif
+    for (; j < n; j++) count += s[j] == c;
+    return count;
 }
 
-void editorInsertChar(int c) {
+int simdFindCntrl(const char *s, int n) {
+    /*
+    Returns the index of the first control character in s, the
+    bytes below 32 and DEL, or n if there is none
+    */
+    int j = 0;
+#if defined(__SSE2__) && defined(__GNUC__)
+    if (n >= 64 && simdHasAvx2()) {
+        j = simdFindCntrlAvx2(s, n);
+        if (j < (n & ~31)) return j;
+    }
+    __m128i lim = _mm_set1_epi8(31), del = _mm_set1_epi8(127);
+    for (; j + 16 <= n; j += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + j));
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, lim), v),
+                                 _mm_cmpeq_epi8(v, del));
+        unsigned int bits = _mm_movemask_epi8(m);
+        if (bits) return j + __builtin_ctz(bits);
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    uint8x16_t lim = vdupq_n_u8(32), del = vdupq_n_u8(127);
+    for (; j + 16 <= n; j += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)(s + j));
+        if (vmaxvq_u8(vorrq_u8(vcltq_u8(v, lim), vceqq_u8(v, del)))) break;
+    }
+#endif
+    for (; j < n; j++)
+        if ((unsigned char)s[j] < 32 || s[j] == 127) return j;
+    return n;
+}
+
+int editorRowCxToRx(erow *row, int cx) {
+    /*
+    Converts the cursor index to the render index. The scan starts
+    from the last conversion on the same row if it is to the left,
+    or from the last checkpoint of a long row that edits since the
+    last scan left alone, and skips from tab to tab
+    */
+    int rx = 0;
+    int j = 0;
+    struct longRow *lr = row->lr;
+    if (lr && lr->nmarks) {
+        struct longMark *m = &lr->marks[editorLongMarkAt(lr,
+                                        cx < lr->edit_lo ? cx : lr->edit_lo)];
+        rx = m->rx;
+        j = m->cx;
+    }
+    struct rxCache *c = &E.rxcache;
+    if (c->chars == row->chars && c->size == row->size && c->cx <= cx && c->cx > j) {
+        rx = c->rx;
+        j = c->cx;
+    }
+
+    while (j < cx) {
+        int n;
+        char *chars = editorRowSegment(row, j, &n);
+        if (n > cx - j) n = cx - j;
+        char *p = chars, *end = chars + n, *tab;
+        while ((tab = memchr(p, '\t', end - p)) != NULL) {
+            rx += tab - p;
+            rx += KAI_TAB_STOP - (rx % KAI_TAB_STOP);
+            p = tab + 1;
+        }
+        rx += end - p;
+        j += n;
+    }
+
+    c->chars = row->chars;
+    c->size = row->size;
+    c->cx = cx;
+    c->rx = rx;
+    return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+    /*
+    Converts the render index to the cursor index, skipping from
+    tab to tab like editorRowCxToRx
+    */
+    int cur_rx = 0;
+    int cx = 0;
+    struct longRow *lr = row->lr;
+    if (lr && lr->nmarks) {
+        struct longMark *m = &lr->marks[editorLongMarkRx(lr, rx, lr->edit_lo)];
+        cur_rx = m->rx;
+        cx = m->cx;
+    }
+    struct rxCache *c = &E.rxcache;
+    if (c->chars == row->chars && c->size == row->size && c->rx <= rx && c->cx > cx) {
+        cur_rx = c->rx;
+        cx = c->cx;
+    }
+
+    while (cx < row->size) {
+        int n;
+        char *chars = editorRowSegment(row, cx, &n);
+        char *p = chars, *end = chars + n, *tab;
+        while (p < end) {
+            tab = memchr(p, '\t', end - p);
+            int run = (tab ? tab : end) - p;
+            if (rx - cur_rx < run) return cx + (rx - cur_rx);
+            cur_rx += run;
+            cx += run;
+            if (tab == NULL) break;
+
+            cur_rx += KAI_TAB_STOP - (cur_rx % KAI_TAB_STOP);
+            if (cur_rx > rx) return cx;
+            cx++;
+            p = tab + 1;
+        }
+    }
+    return cx;
+}
+
+int editorRenderChars(char *chars, int size, int rx, char *render) {
+    /*
+    Expands the tabs in chars into render, if chars start at render
+    column rx, and returns the rendered length, render is NUL-terminated.
+    The text between tabs is copied a run at a time
+    */
+    int idx = 0;
+    char *p = chars, *end = chars + size, *tab;
+    while ((tab = memchr(p, '\t', end - p)) != NULL) {
+        memcpy(&render[idx], p, tab - p);
+        idx += tab - p;
+        render[idx++] = ' ';
+
+        while ((rx + idx) % KAI_TAB_STOP != 0) render[idx++] = ' ';
+        p = tab + 1;
+    }
+    memcpy(&render[idx], p, end - p);
+    idx += end - p;
+
+    render[idx] = '\0';
+    return idx;
+}
+
+int editorRenderSpan(erow *row, int from, int to, int rx, char *render) {
+    /*
+    Renders the chars between from and to, which start at render
+    column rx, and returns the rendered length
+    */
+    int idx = 0;
+    while (from < to) {
+        int n;
+        char *chars = editorRowSegment(row, from, &n);
+        if (n > to - from) n = to - from;
+        idx += editorRenderChars(chars, n, rx + idx, &render[idx]);
+        from += n;
+    }
+    render[idx] = '\0';
+    return idx;
+}
+
+int editorHighlightSame(struct hlState *a, struct hlState *b) {
+    /*
+    Returns whether the highlighting carries on the same way from
+    two states
+    */
+    return a->in_comment == b->in_comment && a->in_string == b->in_string &&
+           a->prev_sep == b->prev_sep && a->line_comment == b->line_comment &&
+           a->skip == b->skip && (!a->skip || a->skip_hl == b->skip_hl) &&
+           a->prev_hl == b->prev_hl;
+}
+
+int editorRowFindTab(erow *row, int from) {
+    /*
+    Returns the index of the first tab from index from on, -1 if none
+    */
+    while (from < row->size) {
+        int n;
+        char *chars = editorRowSegment(row, from, &n);
+        char *tab = memchr(chars, '\t', n);
+        if (tab) return from + (tab - chars);
+        from += n;
+    }
+    return -1;
+}
+
+int editorLongRowSpan(erow *row, int cx, int n, int rx, struct hlState *st,
+                      char **render, unsigned char **hl) {
+    /*
+    Renders and highlights n chars of a long row from index cx, which is
+    at render column rx, into scratch buffers carrying on from st, and
+    returns the rendered length
+    */
+    static char *rbuf = NULL;
+    static unsigned char *hbuf = NULL;
+    if (rbuf == NULL) {
+        int cap = (KAI_LONG_CHUNK + KAI_HL_LOOKAHEAD) * KAI_TAB_STOP + 1;
+        rbuf = malloc(cap);
+        hbuf = malloc(cap);
+        if (rbuf == NULL || hbuf == NULL) die("malloc");
+    }
+
+    int ahead = row->size - cx - n;
+    if (ahead > KAI_HL_LOOKAHEAD) ahead = KAI_HL_LOOKAHEAD;
+
+    int len = editorRenderSpan(row, cx, cx + n, rx, rbuf);
+    int end = len + editorRenderSpan(row, cx + n, cx + n + ahead, rx + len,
+                                     &rbuf[len]);
+    editorHighlightSpan(st, rbuf, len, end, hbuf);
+    *render = rbuf;
+    *hl = hbuf;
+    return len;
+}
+
+void editorLongRowPush(struct longRow *lr, struct longMark *m) {
+    if (lr->nmarks == lr->capmarks) {
+        lr->capmarks = lr->capmarks ? lr->capmarks * 2 : 16;
+        lr->marks = realloc(lr->marks, sizeof(struct longMark) * lr->capmarks);
+        if (lr->marks == NULL) die("realloc");
+    }
+    lr->marks[lr->nmarks++] = *m;
+}
+
+int editorLongRowUpdate(erow *row, int in_comment, int upto) {
+    /*
+    Brings the checkpoints of a long row up to date and returns its
+    end state. The scan starts again from the last checkpoint the
+    edits since the last one can't have changed, and stops at the
+    first old checkpoint in the untouched tail that it reaches in the
+    same highlight state, with the render columns shifted by whole tab
+    stops or no tab left behind it: the rest of the row is the same as
+    it was. Without syntax highlighting it also stops past column upto
+    */
+    struct longRow *lr = editorLongRowInit(row);
+    if (lr->nmarks == 0 || lr->marks[0].st.in_comment != in_comment) {
+        struct longMark m = { 0, 0, { 0 } };
+        editorHighlightInit(&m.st, in_comment);
+        lr->nmarks = 0;
+        editorLongRowPush(lr, &m);
+        lr->edit_tail = 0;
+    }
+    int s = editorLongMarkAt(lr, lr->edit_lo < INT_MAX ?
+                                 lr->edit_lo - KAI_HL_LOOKAHEAD : INT_MAX);
+
+    // Old checkpoints in the untouched tail, moved to where it is now
+    int first = s + 1;
+    while (first < lr->nmarks &&
+           lr->scan_size - lr->marks[first].cx > lr->edit_tail) first++;
+    int ncand = lr->nmarks - first;
+    struct longMark *cand = NULL;
+    if (ncand) {
+        cand = malloc(sizeof(struct longMark) * ncand);
+        if (cand == NULL) die("malloc");
+        memcpy(cand, &lr->marks[first], sizeof(struct longMark) * ncand);
+        for (int j = 0; j < ncand; j++) cand[j].cx += row->size - lr->scan_size;
+    }
+    lr->nmarks = s + 1;
+
+    struct longMark m = lr->marks[s];
+    int c = 0, tab = -2;
+    while (m.cx < row->size) {
+        while (c < ncand && cand[c].cx <= m.cx) c++;
+        int to = row->size - m.cx > KAI_LONG_CHUNK ? m.cx + KAI_LONG_CHUNK : row->size;
+        if (c < ncand && cand[c].cx < to) to = cand[c].cx;
+
+        char *render;
+        unsigned char *hl;
+        m.rx += editorLongRowSpan(row, m.cx, to - m.cx, m.rx, &m.st, &render, &hl);
+        m.cx = to;
+
+        if (c < ncand && cand[c].cx == m.cx) {
+            int d = m.rx - cand[c].rx;
+            if (d % KAI_TAB_STOP && tab == -2) tab = editorRowFindTab(row, m.cx);
+            if (editorHighlightSame(&m.st, &cand[c].st) &&
+                (d % KAI_TAB_STOP == 0 || tab < 0)) {
+                for (; c < ncand; c++) {
+                    cand[c].rx += d;
+                    editorLongRowPush(lr, &cand[c]);
+                }
+                break;
+            }
+            c++;
+        }
+        editorLongRowPush(lr, &m);
+        if (E.syntax == NULL && m.rx >= upto) break;
+    }
+    free(cand);
+
+    lr->scan_size = row->size;
+    lr->edit_lo = INT_MAX;
+    lr->edit_tail = row->size;
+
+    struct longMark *last = &lr->marks[lr->nmarks - 1];
+    lr->rwidth = last->cx == row->size ? last->rx : INT_MAX;
+    return E.syntax && last->cx == row->size ? last->st.in_comment : 0;
+}
+
+void editorLongRowBuild(erow *row) {
+    /*
+    Renders and highlights the visible columns of a long row, starting
+    from the checkpoint before them
+    */
+    struct longRow *lr = row->lr;
+    int from = E.coloff, to = E.coloff + E.screencols;
+    struct longMark *last = &lr->marks[lr->nmarks - 1];
+    if (last->cx < row->size && last->rx < to)
+        editorLongRowUpdate(row, lr->marks[0].st.in_comment, to);
+
+    free(row->render);
+    row->render = malloc(to - from + 1);
+    if (row->render == NULL) die("malloc");
+    unsigned char *window = editorHlScratch(to - from);
+    row->rsize = 0;
+    lr->roff = from;
+
+    struct longMark m = lr->marks[editorLongMarkRx(lr, from, INT_MAX)];
+    while (m.cx < row->size && m.rx < to) {
+        int n = row->size - m.cx > KAI_LONG_CHUNK ? KAI_LONG_CHUNK : row->size - m.cx;
+        char *render;
+        unsigned char *hl;
+        int len = editorLongRowSpan(row, m.cx, n, m.rx, &m.st, &render, &hl);
+
+        if (m.rx + len > from) {
+            int s = m.rx > from ? m.rx : from;
+            int e = m.rx + len < to ? m.rx + len : to;
+            memcpy(&row->render[s - from], &render[s - m.rx], e - s);
+            memcpy(&window[s - from], &hl[s - m.rx], e - s);
+            row->rsize = e - from;
+        }
+        m.rx += len;
+        m.cx += n;
+    }
+    row->render[row->rsize] = '\0';
+    editorRowSetHl(row, window, row->rsize);
+}
+
+int editorLongRowScan(erow *row, int in_comment, int build) {
+    /*
+    Commits the edits of a long row and returns its end state, if
+    build is set its visible columns are rendered and highlighted
+    too. The rest of the row is never materialized
+    */
+    int state = editorLongRowUpdate(row, in_comment, E.coloff + E.screencols);
+    if (build) editorLongRowBuild(row);
+    return state;
+}
+
+void editorRowWindow(erow *row) {
+    /*
+    Renders the visible columns of a long row again if coloff has
+    moved since they were
+    */
+    struct longRow *lr = row->lr;
+    if (lr == NULL) return;
+    if (E.coloff >= lr->roff &&
+        (E.coloff + E.screencols <= lr->roff + row->rsize ||
+         lr->roff + row->rsize >= lr->rwidth))
+        return;
+    editorLongRowBuild(row);
+}
+void editorRenderRow(erow *row) {
+    /*
+    Builds the render of a row by converting tabs to spaces,
+    a row without tabs is its own render
+    */
+    int tabs = simdCountByte(row->chars, row->size, '\t');
+
+    editorRowDropRender(row);
+    if (tabs == 0) {
+        // Nothing to expand, the chars are drawn as they are
+        row->render = row->chars;
+        row->rsize = row->size;
+        row->shared = 1;
+    } else {
+        int cap = row->size + tabs * (KAI_TAB_STOP - 1) + 1;
+        row->render = slabAlloc(&E.slab, cap);
+        row->rsize = editorRenderChars(row->chars, row->size, 0, row->render);
+        row->render = slabRealloc(&E.slab, row->render, cap, row->rsize + 1);
+    }
+}
+
+void editorUpdateRow(erow *row) {
+    /*
+    Updates the render and highlight of a row, long rows are
+    rendered as they are highlighted
+    */
+    if (!editorRowLong(row)) editorRenderRow(row);
+    editorUpdateSyntax(row);
+}
+
+void editorRowTouch(erow *row) {
+    /*
+    Marks a row whose chars were edited. Its render is dropped and its
+    highlight state invalidated, both are rebuilt once when the edits
+    are committed by the frontier pass of the next screen refresh, no
+    matter how many edits the row took in between
+    */
+    E.rxcache.size = -1;
+    editorRowDropRender(row);
+    row->hl_start = -1;
+    editorSyntaxInvalidate(rowtreeIndex(row));
+}
+
+void editorRowPrepare(erow *row) {
+    /*
+    Builds the render and highlight buffers of a lazily loaded row,
+    the highlight frontier has to be past the row for them to be right
+    */
+    if (row->render == NULL) editorUpdateRow(row);
+}
+
+int editorSyntaxScanWith(erow *row, int in_comment, struct hlScratch *sc) {
+    /*
+    Works out the end state of a row whose render and highlight
+    buffers haven't been built, using the given scratch buffers
+    */
+    if (row->size * KAI_TAB_STOP + 1 > sc->cap) {
+        sc->cap = row->size * KAI_TAB_STOP + 1;
+        sc->render = realloc(sc->render, sc->cap);
+        sc->hl = realloc(sc->hl, sc->cap);
+        if (sc->render == NULL || sc->hl == NULL) die("realloc");
+    }
+
+    // Rows without tabs are highlighted straight from their chars
+    if (memchr(row->chars, '\t', row->size) == NULL)
+        return editorHighlightLine(row->chars, row->size, sc->hl, in_comment);
+    int rsize = editorRenderChars(row->chars, row->size, 0, sc->render);
+    return editorHighlightLine(sc->render, rsize, sc->hl, in_comment);
+}
+
+int editorSyntaxScan(erow *row, int in_comment) {
+    /*
+    Works out the end state of a row on the UI thread's scratch
+    buffers
+    */
+    static struct hlScratch sc = { NULL, NULL, 0 };
+    return editorSyntaxScanWith(row, in_comment, &sc);
+}
+
+void *editorSyntaxWorker(void *arg) {
+    /*
+    Highlight thread, works out the states of a run of rows as if
+    it started outside a comment. Rows that have a render, were
+    edited or are long are left to editorSyntaxAdvance, the rows
+    after them are worked out as if they started a run
+    */
+    struct hlWorker *w = arg;
+    struct hlScratch sc = { NULL, NULL, 0 };
+    int state = 0;
+    erow *row = w->first;
+    for (int j = 0; j < w->n; j++, row = rowtreeNext(row)) {
+        if (row->render || !row->mapped || editorRowLong(row)) {
+            state = 0;
+            continue;
+        }
+        row->hl_start = state;
+        state = row->hl_open_comment = editorSyntaxScanWith(row, state, &sc);
+    }
+    free(sc.render);
+    free(sc.hl);
+    return NULL;
+}
+
+int editorSyntaxParallel(int from) {
+    /*
+    Works out the highlight states of the rows from row from on, on
+    every processor, KAI_HL_PARALLEL rows each. A run that turns out
+    to start inside a comment has its states wrong up to where they
+    meet the right ones again, the frontier pass that follows
+    highlights those rows again and skips over the rest, so the
+    result is the same as a pass on one thread. Returns the row the
+    states were worked out up to, from itself if too few rows are
+    left or there is a single processor
+    */
+    static long nthreads = 0;
+    if (nthreads == 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (nthreads < 1) nthreads = 1;
+        if (nthreads > KAI_HL_THREADS) nthreads = KAI_HL_THREADS;
+    }
+    int n = nthreads * KAI_HL_PARALLEL;
+    if (n > E.numrows - from) n = E.numrows - from;
+    if (nthreads < 2 || n < 2 * KAI_HL_PARALLEL) return from;
+
+    struct hlWorker w[KAI_HL_THREADS];
+    int per = (n + nthreads - 1) / nthreads;
+    int t = 0;
+    for (int at = 0; at < n; at += per, t++) {
+        w[t].first = editorRowAt(from + at);
+        w[t].n = n - at < per ? n - at : per;
+        if (pthread_create(&w[t].thread, NULL, editorSyntaxWorker, &w[t]) != 0)
+            die("pthread_create");
+    }
+    while (t--) pthread_join(w[t].thread, NULL);
+    return from + n;
+}
+
+void editorSyntaxAdvance(int upto) {
+    /*
+    Moves the highlight frontier down to the given row, only the
+    rows whose start state no longer matches the end state of the
+    row above are highlighted again. Edited rows get their render
+    rebuilt on the way, this is where a batch of edits is committed
+    */
+    if (E.syntax == NULL) {
+        E.hl_frontier = E.numrows;
+        return;
+    }
+    if (upto > E.numrows) upto = E.numrows;
+    if (E.hl_frontier >= upto) return;
+
+    erow *row = editorRowAt(E.hl_frontier);
+    erow *prev = rowtreePrev(row);
+    int state = prev ? prev->hl_open_comment : 0;
+
+    for (; E.hl_frontier < upto; E.hl_frontier++, row = rowtreeNext(row)) {
+        if (row->hl_start != state) {
+            row->hl_start = state;
+            if (editorRowLong(row)) {
+                int build = row->render != NULL || !row->mapped;
+                row->hl_open_comment = editorLongRowScan(row, state, build);
+            } else {
+                if (row->render == NULL && !row->mapped) editorRenderRow(row);
+                if (row->render)
+                    row->hl_open_comment = editorRowHighlight(row, state);
+                else
+                    row->hl_open_comment = editorSyntaxScan(row, state);
+            }
+        }
+        state = row->hl_open_comment;
+    }
+}
+
+int editorRowHeld(erow *row) {
+    /*
+    Returns whether the snapshot of the running save points at
+    the row's heap buffer, which must then be left untouched
+    */
+    return E.save && !row->mapped && row->snap == E.save_gen;
+}
+
+void editorSaveDefer(char *chars, int cap) {
+    /*
+    Hands a row buffer of cap bytes held by the running save over
+    to it, to be freed once the save is done
+    */
+    struct saveJob *job = E.save;
+    if (job->ndeferred == job->capdeferred) {
+        job->capdeferred = job->capdeferred ? job->capdeferred * 2 : 64;
+        job->deferred = realloc(job->deferred, sizeof(struct iovec) * job->capdeferred);
+        if (job->deferred == NULL) die("realloc");
+    }
+    job->deferred[job->ndeferred].iov_base = chars;
+    job->deferred[job->ndeferred].iov_len = cap;
+    job->ndeferred++;
+}
+
+void editorRowFreeChars(erow *row) {
+    /*
+    Releases the chars of a row going away
+    */
+    if (row->mapped) return;
+    if (editorRowHeld(row)) editorSaveDefer(row->chars, editorRowCap(row));
+    else slabFree(&E.slab, row->chars, editorRowCap(row));
+}
+
+void editorRowOwn(erow *row) {
+    /*
+    Copies a row that still points into the file mapping, or whose
+    chars a running save is writing out, to a heap buffer of its
+    own so that it can be edited
+    */
+    int held = editorRowHeld(row);
+    if (!row->mapped && !held) return;
+
+    char *chars = slabAlloc(&E.slab, row->size + 1);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+    if (held) editorSaveDefer(row->chars, editorRowCap(row));
+    row->chars = chars;
+    if (row->lr) row->lr->cap = row->size + 1;
+    row->mapped = 0;
+    row->snap = 0;
+}
+
+void editorCloseGap() {
+    /*
+    Closes the open gap, if any, so that the chars of every row are
+    contiguous again for the code that reads rows as a whole
+    */
+    if (E.gaprow < 0) return;
+    erow *row = editorRowAt(E.gaprow);
+    struct longRow *lr = row->lr;
+    if (lr->gaplen)
+        memmove(&row->chars[lr->gap], &row->chars[lr->gap + lr->gaplen],
+                row->size - lr->gap + 1);
+    lr->gaplen = 0;
+    E.gaprow = -1;
+}
+
+void editorRowOpenGap(erow *row, int at, int len) {
+    /*
+    Moves the gap of a long row to index at and makes it at least len
+    bytes long. The gap grows by a quarter of the row at a time, so
+    inserts and deletes around the cursor only move the bytes between
+    it and the last edit
+    */
+    int idx = rowtreeIndex(row);
+    if (E.gaprow != idx) {
+        editorCloseGap();
+        E.gaprow = idx;
+    }
+
+    struct longRow *lr = editorLongRowInit(row);
+    if (lr->gaplen == 0) lr->gap = at;
+
+    if (lr->gaplen < len) {
+        int gaplen = len + KAI_LONG_ROW + row->size / 4;
+        row->chars = slabRealloc(&E.slab, row->chars, lr->cap, row->size + gaplen + 1);
+        lr->cap = row->size + gaplen + 1;
+        memmove(&row->chars[lr->gap + gaplen], &row->chars[lr->gap + lr->gaplen],
+                row->size - lr->gap + 1);
+        lr->gaplen = gaplen;
+    }
+
+    if (at < lr->gap)
+        memmove(&row->chars[at + lr->gaplen], &row->chars[at], lr->gap - at);
+    else
+        memmove(&row->chars[lr->gap], &row->chars[lr->gap + lr->gaplen],
+                at - lr->gap);
+    lr->gap = at;
+}
+
+void editorRowResize(erow *row, int size) {
+    /*
+    Makes the chars of a short row hold size bytes and the NUL,
+    the block only changes once the size leaves its size class.
+    Long rows keep their buffer, the gap takes up the slack
+    */
+    if (row->lr) return;
+    row->chars = slabRealloc(&E.slab, row->chars, row->size + 1, size + 1);
+}
+
+void editorRowCopy(erow *row, int from, int to, char *dst) {
+    /*
+    Copies the chars between from and to out of a row, wherever
+    the gap splits them
+    */
+    while (from < to) {
+        int n;
+        char *chars = editorRowSegment(row, from, &n);
+        if (n > to - from) n = to - from;
+        memcpy(dst, chars, n);
+        dst += n;
+        from += n;
+    }
+}
+
+struct undoRecord *editorUndoLog(int type, int row, int col) {
+    /*
+    Appends a record for an edit to the journal and returns it, the
+    edits that were undone can't be redone anymore
+    */
+    struct editorUndo *u = &E.undo;
+    if (u->pos < u->nrecs) {
+        u->text.len = u->recs[u->pos].off;
+        u->nrecs = u->pos;
+    }
+    if (!u->open) {
+        u->step++;
+        u->open = 1;
+    }
+    if (u->nrecs == u->cap) {
+        u->cap = u->cap ? u->cap * 2 : 256;
+        u->recs = realloc(u->recs, sizeof(struct undoRecord) * u->cap);
+        if (u->recs == NULL) die("realloc");
+    }
+
+    struct undoRecord *r = &u->recs[u->nrecs++];
+    u->pos = u->nrecs;
+    r->type = type;
+    r->step = u->step;
+    r->row = row;
+    r->col = col;
+    r->n = 0;
+    r->off = u->text.len;
+    r->len = 0;
+    r->cx = r->ax = E.cx;
+    r->cy = r->ay = E.cy;
+    return r;
+}
+
+struct undoRecord *editorUndoLast(int type, int row) {
+    /*
+    Returns the last record if it is of the given type on the given
+    row and the step it belongs to is still open, so that the next
+    edit may be merged into it
+    */
+    struct editorUndo *u = &E.undo;
+    if (!u->open || u->pos != u->nrecs) return NULL;
+    struct undoRecord *r = &u->recs[u->nrecs - 1];
+    return r->type == type && r->row == row ? r : NULL;
+}
+
+void editorUndoText(struct undoRecord *r, const char *s, int len) {
+    abufAppend(&E.undo.text, s, len);
+    r->len += len;
+}
+
+void editorUndoInsert(erow *row, int at, const char *s, int len) {
+    /*
+    Logs text inserted into a row, text typed right behind the text
+    of the last record is added to it
+    */
+    if (E.undo.replay) return;
+    int idx = rowtreeIndex(row);
+    struct undoRecord *r = editorUndoLast(UNDO_INSERT, idx);
+    if (r == NULL || r->col + r->len != at) r = editorUndoLog(UNDO_INSERT, idx, at);
+    editorUndoText(r, s, len);
+}
+
+void editorUndoDelete(erow *row, int at, int len) {
+    /*
+    Logs chars about to be deleted from a row. A run of deletes at one
+    column, or of backspaces in front of it, grows the last record
+    */
+    if (E.undo.replay) return;
+    int idx = rowtreeIndex(row);
+    struct abuf *t = &E.undo.text;
+    struct undoRecord *r = editorUndoLast(UNDO_DELETE, idx);
+
+    if (r && at + len == r->col) {
+        // The record's text is the last in the journal
+        abufGrow(t, len);
+        memmove(&t->b[r->off + len], &t->b[r->off], r->len);
+        editorRowCopy(row, at, at + len, &t->b[r->off]);
+        t->len += len;
+        r->col = at;
+        r->len += len;
+        return;
+    }
+    if (r == NULL || r->col != at) r = editorUndoLog(UNDO_DELETE, idx, at);
+    abufGrow(t, len);
+    editorRowCopy(row, at, at + len, &t->b[t->len]);
+    t->len += len;
+    r->len += len;
+}
+
+void editorUndoRows(int type, int at, int n) {
+    /*
+    Logs n rows from at that were just inserted or are about to be
+    deleted, as one record
+    */
+    if (E.undo.replay) return;
+    struct abuf *t = &E.undo.text;
+    struct undoRecord *r = editorUndoLog(type, at, 0);
+    r->n = n;
+
+    erow *row = editorRowAt(at);
+    for (int j = 0; j < n; j++, row = rowtreeNext(row)) {
+        if (j) editorUndoText(r, "\n", 1);
+        abufGrow(t, row->size);
+        editorRowCopy(row, 0, row->size, &t->b[t->len]);
+        t->len += row->size;
+        r->len += row->size;
+    }
+}
+
+void editorUndoBreak() {
+    /*
+    Ends the current step, the next edit starts a new one. The cursor
+    is kept for redoing the step, and once the journal outgrows
+    KAI_UNDO_LIMIT its oldest steps are dropped down to half of it
+    */
+    struct editorUndo *u = &E.undo;
+    if (!u->open) return;
+    u->open = 0;
+    u->recs[u->nrecs - 1].ax = E.cx;
+    u->recs[u->nrecs - 1].ay = E.cy;
+
+    long long size = u->text.len + (long long)u->nrecs * sizeof(struct undoRecord);
+    if (size <= KAI_UNDO_LIMIT) return;
+
+    int k = 0;
+    while (size > KAI_UNDO_LIMIT / 2 && u->recs[k].step != u->step) {
+        int end = k;
+        while (u->recs[end].step == u->recs[k].step) end++;
+        size -= u->recs[end].off - u->recs[k].off +
+                (long long)(end - k) * sizeof(struct undoRecord);
+        k = end;
+    }
+
+    int off = u->recs[k].off;
+    memmove(u->text.b, &u->text.b[off], u->text.len - off);
+    u->text.len -= off;
+    u->nrecs -= k;
+    u->pos = u->nrecs;
+    memmove(u->recs, &u->recs[k], sizeof(struct undoRecord) * u->nrecs);
+    for (int j = 0; j < u->nrecs; j++) u->recs[j].off -= off;
+}
+
+void editorRowInit(erow *row, char *chars, int len, int mapped) {
+    /*
+    Sets up a fresh row slot holding len chars, its render and
+    highlight buffers are built once it is first drawn
+    */
+    row->size = len;
+    row->chars = chars;
+    row->rsize = 0;
+    row->render = NULL;
+    row->hl = NULL;
+    row->hl_start = -1;
+    row->hl_open_comment = 0;
+    row->mapped = mapped;
+    row->shared = 0;
+    row->snap = 0;
+    row->lr = NULL;
+}
+
+void editorInsertRows(int at, char **lines, size_t *lens, int n) {
+    /*
+    Inserts n rows into the editor in one go, the row tree opens
+    slots for them a leaf at a time and the row bookkeeping is
+    done once for all of them
+    */
+    if (at < 0 || at > E.numrows || n <= 0) return;
+
+    for (int j = 0; j < n;) {
+        int got;
+        erow *row = rowtreeInsertSpan(&E.rows, at + j, n - j, &got);
+        for (int k = 0; k < got; k++, j++) {
+            char *chars = slabAlloc(&E.slab, lens[j] + 1);
+            memcpy(chars, lines[j], lens[j]);
+            chars[lens[j]] = '\0';
+            editorRowInit(&row[k], chars, lens[j], 0);
+        }
+    }
+    editorUndoRows(UNDO_ROWS_INSERT, at, n);
+
+    if (at < E.hl_frontier) E.hl_frontier += n;
+    if (at <= E.gaprow) E.gaprow += n;
+    editorSyntaxInvalidate(at);
+    E.numrows += n;
+    E.dirty++;
+}
+
+void editorInsertRow(int at, char *s, size_t len) {
+    /*
+    Inserts a row into the editor
+    */
+    editorInsertRows(at, &s, &len, 1);
+}
+
+void editorFreeRow(erow *row) {
+    /*
+    Releases every buffer of a row going away
+    */
+    if (E.rxcache.chars == row->chars) E.rxcache.size = -1;
+    editorRowDropRender(row);
+    editorRowFreeChars(row);
+    editorLongRowFree(row->lr);
+    row->lr = NULL;
+}
+
+void editorDelRows(int at, int n) {
+    /*
+    Deletes n rows from the editor in one go, the row tree drops
+    them a leaf at a time and the row bookkeeping is done once
+    */
+    if (at < 0 || at >= E.numrows || n <= 0) return;
+    if (n > E.numrows - at) n = E.numrows - at;
+
+    editorUndoRows(UNDO_ROWS_DELETE, at, n);
+    erow *row = editorRowAt(at);
+    for (int j = 0; j < n; j++, row = rowtreeNext(row)) editorFreeRow(row);
+    rowtreeRemoveRange(&E.rows, at, n);
+
+    if (E.hl_frontier > at + n) E.hl_frontier -= n;
+    else if (E.hl_frontier > at) E.hl_frontier = at;
+    if (E.gaprow >= at + n) E.gaprow -= n;
+    else if (E.gaprow >= at) E.gaprow = -1;
+
+    row = editorRowAt(at);
+    if (row) {
+        erow *prev = rowtreePrev(row);
+        if (row->hl_start != (prev ? prev->hl_open_comment : 0))
+            editorSyntaxInvalidate(at);
+    }
+
+    E.numrows -= n;
+    E.dirty++;
+}
+
+void editorDelRow(int at) {
+    /*
+    Deletes a row from the editor
+    */
+    editorDelRows(at, 1);
+}
+
+void editorRowInsertChar(erow *row, int at, int c) {
+    if (at < 0 || at > row->size) at = row->size;
+
+    char ch = c;
+    editorUndoInsert(row, at, &ch, 1);
+    editorRowOwn(row);
+    if (editorRowLong(row)) {
+        editorRowOpenGap(row, at, 1);
+        row->chars[row->lr->gap++] = c;
+        row->lr->gaplen--;
+        row->size++;
+        editorLongRowEdit(row, at, row->size - at - 1);
+    } else {
+        editorRowResize(row, row->size + 1);
+        memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
+        row->size++;
+        row->chars[at] = c;
+    }
+
+    editorRowTouch(row);
+    E.dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len);
+
+void editorRowAppendString(erow *row, char *s, size_t len) {
+    if (editorRowLong(row) || row->size + len >= KAI_LONG_ROW) {
+        editorRowInsertString(row, row->size, s, len);
+        return;
+    }
+
+    editorUndoInsert(row, row->size, s, len);
+    editorRowOwn(row);
+    editorRowResize(row, row->size + len);
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->chars[row->size] = '\0';
+    editorRowTouch(row);
+    E.dirty++;
+}
+
+void editorRowInsertString(erow *row, int at, const char *s, size_t len) {
+    if (at < 0 || at > row->size) at = row->size;
+
+    editorUndoInsert(row, at, s, len);
+    editorRowOwn(row);
+    if (editorRowLong(row) || row->size + len >= KAI_LONG_ROW) {
+        editorRowOpenGap(row, at, len);
+        memcpy(&row->chars[at], s, len);
+        row->lr->gap += len;
+        row->lr->gaplen -= len;
+        editorLongRowEdit(row, at, row->size - at);
+    } else {
+        editorRowResize(row, row->size + len);
+        memmove(&row->chars[at + len], &row->chars[at], row->size - at + 1);
+        memcpy(&row->chars[at], s, len);
+    }
+    row->size += len;
+    editorRowTouch(row);
+    E.dirty++;
+}
+
+void editorRowDelString(erow *row, int at, int len) {
+    /*
+    Deletes len chars of a row from index at
+    */
+    if (at < 0 || at >= row->size || len <= 0) return;
+    if (len > row->size - at) len = row->size - at;
+
+    editorUndoDelete(row, at, len);
+    editorRowOwn(row);
+    if (editorRowLong(row)) {
+        editorRowOpenGap(row, at + len, 0);
+        row->lr->gap -= len;
+        row->lr->gaplen += len;
+        editorLongRowEdit(row, at, row->size - at - len);
+    } else {
+        memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+        editorRowResize(row, row->size - len);
+    }
+    row->size -= len;
+    editorRowTouch(row);
+    E.dirty++;
+}
+
+void editorRowDelChar(erow *row, int at) {
+    editorRowDelString(row, at, 1);
+}
+
+void editorInsertChar(int c) {
     if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
 
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    editorRowInsertChar(editorRowAt(E.cy), E.cx, c);
+    E.cx++;
+}
+
+void editorInsertNewline() {
+    if (E.cx == 0) {
+        editorInsertRow(E.cy, "", 0);
+    } else {
+        editorCloseGap();
+        erow *row = editorRowAt(E.cy);
+        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+
+        row = editorRowAt(E.cy);
+        editorRowDelString(row, E.cx, row->size - E.cx);
+    }
+
+    E.cy++;
+    E.cx = 0;
+}
+
+const char *editorLineBreak(const char *p, const char *end) {
+    while (p < end && *p != '\n' && *p != '\r') p++;
+    return p;
+}
+
+const char *editorSkipBreak(const char *p, const char *end) {
+    if (*p == '\r' && p + 1 < end && p[1] == '\n') return p + 2;
+    return p + 1;
+}
+
+void editorInsertText(const char *s, int len) {
+    /*
+    Inserts a block of text at the cursor in one go: the row is split
+    once, each further line becomes a row of its own, and every row
+    touched is rendered and highlighted once. Lines may end in \n,
+    \r or \r\n
+    */
+    if (E.cy == E.numrows) editorInsertRow(E.numrows, "", 0);
+
+    erow *row = editorRowAt(E.cy);
+    const char *end = s + len;
+    const char *nl = editorLineBreak(s, end);
+    if (nl == end) {
+        editorRowInsertString(row, E.cx, s, len);
+        E.cx += len;
+        return;
+    }
+
+    // The rest of the row ends up behind the last line
+    editorCloseGap();
+    int taillen = row->size - E.cx;
+    char *tail = malloc(taillen + 1);
+    if (tail == NULL) die("malloc");
+    memcpy(tail, &row->chars[E.cx], taillen);
+
+    editorRowDelString(row, E.cx, taillen);
+    editorRowAppendString(row, (char *)s, nl - s);
+
+    // The further lines are inserted as one batch of rows
+    int n = 0, cap = 64;
+    char **lines = malloc(sizeof(char *) * cap);
+    size_t *lens = malloc(sizeof(size_t) * cap);
+    if (lines == NULL || lens == NULL) die("malloc");
+
+    const char *p = editorSkipBreak(nl, end);
+    while (1) {
+        if (n == cap) {
+            cap *= 2;
+            lines = realloc(lines, sizeof(char *) * cap);
+            lens = realloc(lens, sizeof(size_t) * cap);
+            if (lines == NULL || lens == NULL) die("realloc");
+        }
+        nl = editorLineBreak(p, end);
+        if (nl == end) break;
+        lines[n] = (char *)p;
+        lens[n++] = nl - p;
+        p = editorSkipBreak(nl, end);
+    }
+
+    int lastlen = end - p;
+    char *last = malloc(lastlen + taillen + 1);
+    if (last == NULL) die("malloc");
+    memcpy(last, p, lastlen);
+    memcpy(&last[lastlen], tail, taillen);
+    lines[n] = last;
+    lens[n++] = lastlen + taillen;
+    editorInsertRows(E.cy + 1, lines, lens, n);
+    free(last);
+    free(tail);
+    free(lines);
+    free(lens);
+
+    E.cy += n;
+    E.cx = lastlen;
+}
+
+void editorDelChar() {
+    if (E.cy == E.numrows) return;
+    if (E.cx == 0 && E.cy == 0) return;
+
+    erow *row = editorRowAt(E.cy);
+    if (E.cx > 0) {
+        editorRowDelChar(row, E.cx - 1);
+        E.cx--;
+    } else {
+        erow *prev = rowtreePrev(row);
+        E.cx = prev->size;
+        editorCloseGap();
+        editorRowAppendString(prev, row->chars, row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+void editorUndoApply(struct undoRecord *r, int redo) {
+    /*
+    Makes the edit of a record again, or reverts it, through the
+    same row primitives that logged it
+    */
+    char *text = &E.undo.text.b[r->off];
+    int adds = (r->type == UNDO_INSERT || r->type == UNDO_ROWS_INSERT) == redo;
+
+    if (r->type == UNDO_INSERT || r->type == UNDO_DELETE) {
+        erow *row = editorRowAt(r->row);
+        if (adds) editorRowInsertString(row, r->col, text, r->len);
+        else editorRowDelString(row, r->col, r->len);
+    } else if (!adds) {
+        editorDelRows(r->row, r->n);
+    } else {
+        char **lines = malloc(sizeof(char *) * r->n);
+        size_t *lens = malloc(sizeof(size_t) * r->n);
+        if (lines == NULL || lens == NULL) die("malloc");
+
+        const char *p = text, *end = text + r->len;
+        for (int j = 0; j < r->n; j++) {
+            const char *nl = memchr(p, '\n', end - p);
+            if (nl == NULL) nl = end;
+            lines[j] = (char *)p;
+            lens[j] = nl - p;
+            p = nl + 1;
+        }
+        editorInsertRows(r->row, lines, lens, r->n);
+        free(lines);
+        free(lens);
+    }
+}
+
+void editorUndoCursor(int cx, int cy) {
+    E.cy = cy > E.numrows ? E.numrows : cy;
+    erow *row = editorRowAt(E.cy);
+    int rowlen = row ? row->size : 0;
+    E.cx = cx > rowlen ? rowlen : cx;
+}
+
+void editorSetStatusMessage(const char *fmt, ...);
+
+void editorUndo() {
+    /*
+    Reverts the last step, replaying its records backwards so that
+    only the rows it touched change
+    */
+    struct editorUndo *u = &E.undo;
+    editorUndoBreak();
+    if (u->pos == 0) {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+
+    u->replay = 1;
+    int step = u->recs[u->pos - 1].step;
+    struct undoRecord *r;
+    do {
+        r = &u->recs[--u->pos];
+        editorUndoApply(r, 0);
+    } while (u->pos > 0 && u->recs[u->pos - 1].step == step);
+    u->replay = 0;
+    editorUndoCursor(r->cx, r->cy);
+}
+
+void editorRedo() {
+    /*
+    Makes the last undone step again
+    */
+    struct editorUndo *u = &E.undo;
+    editorUndoBreak();
+    if (u->pos == u->nrecs) {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+
+    u->replay = 1;
+    int step = u->recs[u->pos].step;
+    struct undoRecord *r;
+    do {
+        r = &u->recs[u->pos++];
+        editorUndoApply(r, 1);
+    } while (u->pos < u->nrecs && u->recs[u->pos].step == step);
+    u->replay = 0;
+    editorUndoCursor(r->ax, r->ay);
+}
+
+void editorScroll() {
+    E.rx = 0;
+    if (E.cy < E.numrows) {
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
+    }
+
+    if (E.cy < E.rowoff) {
+        E.rowoff = E.cy;
+    }
+    if (E.cy >= E.rowoff + E.screenrows) {
+        E.rowoff = E.cy - E.screenrows + 1;
+    }
+    if (E.rx < E.coloff) {
+        E.coloff = E.rx;
+    }
+    if (E.rx >= E.coloff + E.screencols) {
+        E.coloff = E.rx - E.screencols + 1;
+    }
+}
+
+void frameResize(struct screenFrame *f, int rows, int cols) {
+    /*
+    Resizes a frame and blanks all of its cells
+    */
+    if (f->rows * f->cols != rows * cols) {
+        f->chars = realloc(f->chars, rows * cols);
+        f->attrs = realloc(f->attrs, rows * cols);
+        if ((f->chars == NULL || f->attrs == NULL) && rows * cols != 0) die("realloc");
+    }
+    f->rows = rows;
+    f->cols = cols;
+    memset(f->chars, ' ', rows * cols);
+    memset(f->attrs, ATTR_DEFAULT, rows * cols);
+}
+
+void framePut(struct screenFrame *f, int y, int x, const char *s, int len,
+              unsigned char attr) {
+    /*
+    Writes a string into a frame line, clipped to the frame width
+    */
+    if (x + len > f->cols) len = f->cols - x;
+    if (len <= 0) return;
+
+    memcpy(&f->chars[y * f->cols + x], s, len);
+    memset(&f->attrs[y * f->cols + x], attr, len);
+}
+
+void editorDrawRows(struct screenFrame *f) {
+    /*
+    Draws tilda characters at the end of input
+    to represent the editor screen,
+    draws the welcome message at the center of the screen
+    */
+    long long t_hl = editorStatsClock();
+    editorSyntaxAdvance(E.rowoff + E.screenrows);
+    E.stats.hl_ns = editorStatsSince(t_hl);
+
+    erow *row = editorRowAt(E.rowoff);
+    for (int i = 0; i < E.screenrows; i++) {
+        int filerow = i + E.rowoff;
+        char *chars = &f->chars[i * f->cols];
+        unsigned char *attrs = &f->attrs[i * f->cols];
+
+        if (filerow >= E.numrows) {
+            if (E.numrows == 0 && i == E.screenrows / 3) {
+                char welcome[80];
+                int welcomelen = snprintf(welcome, sizeof(welcome),
+                    "Kai editor -- version %s", KAI_VERSION);
+                
+                if (welcomelen > E.screencols) welcomelen = E.screencols;
+
+                int padding = (E.screencols - welcomelen) / 2;
+                if (padding) chars[0] = '~';
+
+                framePut(f, i, padding, welcome, welcomelen, ATTR_DEFAULT);
+            } else {
+                chars[0] = '~';
+            }
+        } else {
+            t_hl = editorStatsClock();
+            editorRowPrepare(row);
+            editorRowWindow(row);
+            E.stats.hl_ns += editorStatsSince(t_hl);
+            int coloff = E.coloff - (row->lr ? row->lr->roff : 0);
+            int len = row->rsize - coloff;
+            if (len < 0) len = 0;
+
+            if (len > E.screencols) len = E.screencols;
+
+            char *c = &row->render[coloff];
+            unsigned char current_color = ATTR_DEFAULT;
+
+            // Skip the runs left of the screen, text past the last
+            // run is drawn as normal
+            int r = 1, nruns = row->hl ? row->hl[0] : 0;
+            int runend = 0;
+            while (r <= nruns && runend + (row->hl[r] & HL_RUN_MAX) <= coloff)
+                runend += row->hl[r++] & HL_RUN_MAX;
+
+            int j = 0;
+            while (j < len) {
+                int hl = HL_NORMAL, k = len;
+                if (r <= nruns) {
+                    hl = row->hl[r] >> 12;
+                    k = runend + (row->hl[r] & HL_RUN_MAX) - coloff;
+                    if (k > len) k = len;
+                }
+
+                while (j < k) {
+                    if (iscntrl(c[j])) {
+                        // Control characters are shown in reverse video
+                        // with the colour of the text before them
+                        chars[j] = (c[j] <= 26) ? '@' + c[j] : '?';
+                        attrs[j] = current_color | ATTR_INVERSE;
+                        j++;
+                        continue;
+                    }
+
+                    int e = j + 1 + simdFindCntrl(&c[j + 1], k - j - 1);
+
+                    current_color = HL_ATTR[hl];
+                    memcpy(&chars[j], &c[j], e - j);
+                    memset(&attrs[j], current_color, e - j);
+                    j = e;
+                }
+
+                if (r <= nruns) runend += row->hl[r++] & HL_RUN_MAX;
+            }
+            row = rowtreeNext(row);
+        }
+    }
+}
+
+void editorDrawMessageBar(struct screenFrame *f) {
+    /*
+    Draws the message bar at the bottom of the screen
+    */
+    int msglen = strlen(E.statusmsg);
+    if (msglen > E.screencols) msglen = E.screencols;
+
+    if (msglen && time(NULL) - E.statusmsg_time < 5)
+        framePut(f, E.screenrows + 1, 0, E.statusmsg, msglen, ATTR_DEFAULT);
+}
+
+void editorDrawStatusBar(struct screenFrame *f) {
+    /*
+    Draws the status bar at the bottom of the screen
+    */
+    int y = E.screenrows;
+    memset(&f->attrs[y * f->cols], ATTR_DEFAULT | ATTR_INVERSE, f->cols);
+
+    char status[80], rstatus[80];
+    int len = 0;
+    if (E.nviews > 1)
+        len = snprintf(status, sizeof(status), "[%d/%d] ", E.view + 1, E.nviews);
+    struct editorBuffer *buf = E.views[E.view].buf;
+    if (E.stats.overlay) {
+        // The last key and frame stand in for the file name
+        struct editorStats *st = &E.stats;
+        len += snprintf(&status[len], sizeof(status) - len,
+            "key %lldus edit %lldus hl %lldus draw %lldus write %lldus %dB %ld allocs",
+            st->key_ns / 1000, st->edit_ns / 1000, st->hl_ns / 1000,
+            st->draw_ns / 1000, st->write_ns / 1000, st->bytes, st->allocs);
+    } else {
+        char tag[40] = "";
+        if (buf->stream) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double secs = (now.tv_sec - buf->stream->start.tv_sec) +
+                (now.tv_nsec - buf->stream->start.tv_nsec) / 1e9;
+            double mb = buf->stream->loaded / 1e6;
+            snprintf(tag, sizeof(tag), "(loading %.0f MB, %.0f MB/s)",
+                mb, secs > 0 ? mb / secs : 0);
+        } else if (buf->follow_fd != -1) {
+            snprintf(tag, sizeof(tag), "(following)");
+        }
+        len += snprintf(&status[len], sizeof(status) - len, "%.20s - %d lines %s%s",
+            E.filename ? E.filename : "[No Name]", E.numrows,
+            E.dirty ? "(modified) " : "", tag);
+    }
+    // snprintf returns the length it would have written
+    if (len >= (int)sizeof(status)) len = sizeof(status) - 1;
+    int rlen = 0;
+    if (E.search.query && E.search.regex && E.search.qlen && !E.search.prog)
+        rlen = snprintf(rstatus, sizeof(rstatus), "bad regex | ");
+    else if (E.search.query)
+        rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d%s matches | ",
+            E.search.current + 1, E.search.count,
+            (E.search.nmerged < E.search.nchunks) ? "+" : "");
+    rlen += snprintf(&rstatus[rlen], sizeof(rstatus) - rlen, "%s | %d:%d/%d",
+        E.syntax ? E.syntax->filetype : "no ft",
+        E.cy + 1, E.cx + 1, E.numrows);
+    
+    if (len > E.screencols) len = E.screencols;
+
+    framePut(f, y, 0, status, len, ATTR_DEFAULT | ATTR_INVERSE);
+    if (len + rlen <= E.screencols)
+        framePut(f, y, E.screencols - rlen, rstatus, rlen, ATTR_DEFAULT | ATTR_INVERSE);
+}
+
+void frameSetAttr(struct abuf *ab, unsigned char *cur, unsigned char attr) {
+    /*
+    Emits the SGR codes switching the terminal from one cell
+    attribute to another
+    */
+    if (*cur == attr) return;
+
+    struct sgrCode *sgr = &SGR[((*cur ^ attr) & ATTR_INVERSE) != 0][attr];
+    abufAppend(ab, sgr->seq, sgr->len);
+    *cur = attr;
+}
+
+void frameScroll(struct abuf *ab, struct screenFrame *shadow, int lines, int n) {
+    /*
+    Scrolls the top lines of the terminal by n rows through a scroll
+    region, positive n moving the content up, and shifts the shadow
+    frame to match
+    */
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "\x1b[m\x1b[1;%dr\x1b[%d;1H",
+        lines, n > 0 ? lines : 1);
+    abufAppend(ab, buf, len);
+    if (n > 0) abufAppendRepeat(ab, '\n', n);
+    for (int j = 0; j < -n; j++) abufAppend(ab, "\x1bM", 2);
+    abufAppend(ab, "\x1b[r", 3);
+
+    int cols = shadow->cols;
+    int keep = (lines - abs(n)) * cols;
+    int from = (n > 0) ? n * cols : 0;
+    int to = (n > 0) ? 0 : -n * cols;
+    int blank = (n > 0) ? keep : 0;
+
+    memmove(&shadow->chars[to], &shadow->chars[from], keep);
+    memmove(&shadow->attrs[to], &shadow->attrs[from], keep);
+    memset(&shadow->chars[blank], ' ', abs(n) * cols);
+    memset(&shadow->attrs[blank], ATTR_DEFAULT, abs(n) * cols);
+}
+
+void frameFlush(struct abuf *ab, struct screenFrame *f, struct screenFrame *shadow) {
+    /*
+    Emits the cells that differ between the new frame and the last
+    frame sent to the terminal, then makes the new frame the shadow.
+    Nearby changes are merged into one span, a blank line tail is
+    cleared with '\x1b[K', and a small vertical scroll of the text
+    area is done by the terminal instead of redrawing it
+    */
+    unsigned char cur = ATTR_DEFAULT;
+    abufAppend(ab, "\x1b[m", 3);
+
+    if (shadow->rows != f->rows || shadow->cols != f->cols) {
+        abufAppend(ab, "\x1b[2J", 4);
+        frameResize(shadow, f->rows, f->cols);
+        shadow->rowoff = f->rowoff;
+        shadow->coloff = f->coloff;
+    }
+
+    int scroll = f->rowoff - shadow->rowoff;
+    if (scroll && abs(scroll) < E.screenrows && f->coloff == shadow->coloff)
+        frameScroll(ab, shadow, E.screenrows, scroll);
+
+    for (int y = 0; y < f->rows; y++) {
+        char *nc = &f->chars[y * f->cols], *oc = &shadow->chars[y * f->cols];
+        unsigned char *na = &f->attrs[y * f->cols], *oa = &shadow->attrs[y * f->cols];
+
+        int end = f->cols;
+        while (end > 0 && nc[end - 1] == ' ' && na[end - 1] == ATTR_DEFAULT) end--;
+
+        int x = 0;
+        while (x < f->cols) {
+            if (nc[x] == oc[x] && na[x] == oa[x]) {
+                x++;
+                continue;
+            }
+
+            int start = x, last = x;
+            for (x++; x < f->cols && x - last <= KAI_DIFF_GAP; x++)
+                if (nc[x] != oc[x] || na[x] != oa[x]) last = x;
+
+            char buf[32];
+            int len = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, start + 1);
+            abufAppend(ab, buf, len);
+
+            int stop = (last >= end) ? end : last + 1;
+            for (int j = start, k; j < stop; j = k) {
+                for (k = j + 1; k < stop && na[k] == na[j]; k++);
+                frameSetAttr(ab, &cur, na[j]);
+                abufAppend(ab, &nc[j], k - j);
+            }
+
+            if (last >= end) {
+                frameSetAttr(ab, &cur, ATTR_DEFAULT);
+                abufAppend(ab, "\x1b[K", 3);
+                break;
+            }
+            x = last + 1;
+        }
+    }
+    frameSetAttr(ab, &cur, ATTR_DEFAULT);
+
+    struct screenFrame tmp = *shadow;
+    *shadow = *f;
+    *f = tmp;
+}
+
+void editorRefreshScreen() {
+    /*
+    Refreshes the screen by drawing the editor contents into a
+    frame and sending the terminal only what changed since the
+    last refresh
+    */
+    long long start = editorStatsClock();
+    editorScroll();
+
+    struct screenFrame *f = &E.frame;
+    frameResize(f, E.screenrows + 2, E.screencols);
+    f->rowoff = E.rowoff;
+    f->coloff = E.coloff;
+    editorDrawRows(f);
+    editorDrawStatusBar(f);
+    editorDrawMessageBar(f);
+    long long drawn = editorStatsClock();
+
+    // Kept across refreshes so that a steady repaint doesn't allocate
+    static struct abuf ab = ABUF_INIT;
+    ab.len = 0;
+    abufAppend(&ab, "\x1b[?25l", 6);
+    frameFlush(&ab, f, &E.shadow);
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
+                                            (E.rx - E.coloff + 1));
+    abufAppend(&ab, buf, strlen(buf));
+
+    abufAppend(&ab, "\x1b[?25h", 6);
+
+    write(STDOUT_FILENO, ab.b, ab.len);
+    editorStatsFrame(start, drawn, ab.len);
+}
+
+void editorResize() {
+    /*
+    Picks up the new window size after a SIGWINCH and repaints
+    */
+    if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+        die("getWindowSize");
+    E.screenrows -= 2;
+    editorRefreshScreen();
+}
+
+void editorSetStatusMessage(const char *fmt, ...) {
+    /*
+    Sets the status message with a formatted string
+    */
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+    va_end(ap);
+    E.statusmsg_time = time(NULL);
+}
+
+char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
+    size_t bufsize = 128;
+    char *buf = malloc(bufsize);
+    size_t buflen = 0;
+    buf[0] = '\0';
+
+    while (1) {
+        editorSetStatusMessage(prompt, buf);
+        editorRefreshScreen();
+
+        int ch = editorReadKey();
+        if (ch == DEL_KEY || ch == CTRL_KEY('h') || ch == BACKSPACE) {
+            if (buflen != 0) buf[--buflen] = '\0';
+        } else if (ch == '\x1b') {
+            editorSetStatusMessage("");
+            if (callback) callback(buf, ch);
+            free(buf);
+            return NULL;
+        } else if (ch == '\r') {
+            if (buflen != 0) {
+                editorSetStatusMessage("");
+                if (callback) callback(buf, ch);
+                return buf;
+            }
+        } else if (ch < 128 && !iscntrl((unsigned char)ch)) {
+            if (buflen == bufsize - 1) {
+                bufsize *= 2;
+                buf = realloc(buf, bufsize);
+            }
+
+            buf[buflen++] = ch;
+            buf[buflen] = '\0';
+        } else if (ch == PASTE_START) {
+            // Take the pasted text up to its first line break
+            struct abuf ab = ABUF_INIT;
+            editorReadPaste(&ab);
+            for (int j = 0; j < ab.len; j++) {
+                if (ab.b[j] == '\n' || ab.b[j] == '\r') break;
+                if (iscntrl(ab.b[j]) || (unsigned char)ab.b[j] >= 128) continue;
+                if (buflen == bufsize - 1) {
+                    bufsize *= 2;
+                    buf = realloc(buf, bufsize);
+                }
+                buf[buflen++] = ab.b[j];
+            }
+            buf[buflen] = '\0';
+            abufFree(&ab);
+        }
+
+        if (callback) callback(buf, ch);
+    }
+}
+
+void editorMoveCursor(int key) {
+    /*
+    Moves the cursor based on the key pressed,
+    e.g. arrow keys or wasd
+    */
+    erow *row = editorRowAt(E.cy);
+
+    switch (key) {
+        case ARROW_LEFT:
+            if (E.cx != 0) {
+                E.cx--;
+            } else if (E.cy > 0) {
+                E.cy--;
+                E.cx = editorRowAt(E.cy)->size;
+            }
+            break;
+        case ARROW_RIGHT:
+            if (row && E.cx < row->size) {
+                E.cx++;
+            } else if (row && E.cx == row->size) {
+                E.cy++;
+                E.cx = 0;
+            }
+            break;
+        case ARROW_UP:
+            if (E.cy != 0) E.cy--;
+            break;
+        case ARROW_DOWN:
+            if (E.cy < E.numrows) E.cy++;
+            break;
+    }
+
+    row = editorRowAt(E.cy);
+    int rowlen = row ? row->size : 0;
+    if (E.cx > rowlen) {
+        E.cx = rowlen;
+    }
+}
+
+void editorLoadRow(char *chars, int len) {
+    /*
+    Appends a row pointing at loaded chars that are never freed
+    */
+    editorRowInit(rowtreeInsert(&E.rows, E.numrows), chars, len, 1);
+    E.numrows++;
+}
+
+void editorStreamAdd(struct loadBatch *b, char *p, size_t len) {
+    /*
+    Appends a line to a batch
+    */
+    if (b->n == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 1024;
+        b->lines = realloc(b->lines, sizeof(struct iovec) * b->cap);
+        if (b->lines == NULL) die("realloc");
+    }
+    b->lines[b->n].iov_base = p;
+    b->lines[b->n++].iov_len = len;
+}
+
+struct loadBatch *editorStreamPublish(struct editorStream *st, struct loadBatch *b) {
+    /*
+    Hands a batch over to the UI thread by linking it behind the
+    last one, the release store makes its lines visible first.
+    Returns a new batch to fill
+    */
+    atomic_store_explicit(&st->tail->next, b, memory_order_release);
+    st->tail = b;
+    editorWake();
+
+    b = calloc(1, sizeof(struct loadBatch));
+    if (b == NULL) die("calloc");
+    return b;
+}
+
+void editorStreamMapped(struct editorStream *st, struct loadBatch *b) {
+    /*
+    Splits a file mapping into lines, handing over the lines of
+    every chunk of it in one batch
+    */
+    char *p = st->map, *end = st->map + st->maplen, *nl;
+    madvise(st->map, st->maplen, MADV_SEQUENTIAL);
+
+    while (p < end && !atomic_load_explicit(&st->cancel, memory_order_relaxed)) {
+        char *start = p;
+        char *stop = end - p > KAI_LOAD_CHUNK ? p + KAI_LOAD_CHUNK : end;
+        for (; p < stop; p = nl ? nl + 1 : end) {
+            nl = memchr(p, '\n', end - p);
+            size_t linelen = (nl ? nl : end) - p;
+            while (linelen > 0 && p[linelen - 1] == '\r') linelen--;
+            editorStreamAdd(b, p, linelen);
+        }
+        b->bytes = p - start;
+        b = editorStreamPublish(st, b);
+    }
+
+    madvise(st->map, st->maplen, MADV_NORMAL);
+    free(b);
+}
+
+void editorStreamRead(struct editorStream *st, struct loadBatch *b) {
+    /*
+    Reads a pipe or other file that can't be mapped in large
+    blocks and splits them into lines pointing into the blocks,
+    which are never freed. A line running past the end of a block
+    is moved to the next one. The lines of each read are handed
+    over in one batch
+    */
+    char *block = NULL;
+    size_t cap = 0, len = 0, start = 0;
+
+    while (!atomic_load_explicit(&st->cancel, memory_order_relaxed)) {
+        if (len == cap) {
+            size_t carry = len - start;
+            size_t ncap = carry * 2 > KAI_STREAM_BLOCK ? carry * 2 : KAI_STREAM_BLOCK;
+            char *next = malloc(ncap);
+            if (next == NULL) die("malloc");
+            if (carry) memcpy(next, block + start, carry);
+            // A block no line points into can go
+            if (start == 0) free(block);
+            block = next, cap = ncap, len = carry, start = 0;
+        }
+
+        // Waits in slices so that a cancel is noticed
+        struct pollfd pfd = { st->fd, POLLIN, 0 };
+        if (poll(&pfd, 1, KAI_PROGRESS_MS) == 0) continue;
+
+        ssize_t n = read(st->fd, block + len, cap - len);
+        if (n == -1 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (n == -1) atomic_store(&st->err, errno);
+        if (n <= 0) break;
+
+        char *p = block + start, *end = block + len + n, *nl;
+        while ((nl = memchr(p, '\n', end - p)) != NULL) {
+            size_t linelen = nl - p;
+            while (linelen > 0 && p[linelen - 1] == '\r') linelen--;
+            editorStreamAdd(b, p, linelen);
+            p = nl + 1;
+        }
+        start = p - block;
+        len += n;
+
+        b->bytes = n;
+        b = editorStreamPublish(st, b);
+    }
+
+    if (start < len) editorStreamAdd(b, block + start, len - start);
+    editorStreamPublish(st, b);
+    close(st->fd);
+}
+
+void *editorStreamThread(void *arg) {
+    /*
+    Loader thread, turns the input into batches of lines
+    */
+    struct editorStream *st = arg;
+    struct loadBatch *b = calloc(1, sizeof(struct loadBatch));
+    if (b == NULL) die("calloc");
+
+    if (st->map) editorStreamMapped(st, b);
+    else editorStreamRead(st, b);
+
+    atomic_store_explicit(&st->done, 1, memory_order_release);
+    editorWake();
+    return NULL;
+}
+
+void editorLoadStart(int fd, char *map, size_t maplen) {
+    /*
+    Starts loading the current buffer in the background, from a
+    file mapping or else from fd. The rows are added as the loader
+    thread hands them over, see editorStreamPoll
+    */
+    struct editorStream *st = calloc(1, sizeof(struct editorStream));
+    if (st == NULL) die("calloc");
+    st->fd = fd;
+    st->map = map;
+    st->maplen = maplen;
+    // The queue starts with a batch that was taken already
+    st->head = st->tail = calloc(1, sizeof(struct loadBatch));
+    if (st->head == NULL) die("calloc");
+    clock_gettime(CLOCK_MONOTONIC, &st->start);
+
+    if (pthread_create(&st->thread, NULL, editorStreamThread, st) != 0)
+        die("pthread_create");
+    E.views[E.view].buf->stream = st;
+}
+
+int editorStreamTake(struct editorStream *st) {
+    /*
+    Adds the lines of the next batch in the queue as rows.
+    Returns 0 if the queue was empty
+    */
+    struct loadBatch *b = atomic_load_explicit(&st->head->next, memory_order_acquire);
+    if (b == NULL) return 0;
+
+    for (int j = 0; j < b->n; j++) editorLoadRow(b->lines[j].iov_base, b->lines[j].iov_len);
+    st->loaded += b->bytes;
+    free(b->lines);
+    b->lines = NULL;
+    free(st->head);
+    st->head = b;
+    return 1;
+}
+
+void editorStreamFinish(struct editorBuffer *buf, int cancel) {
+    /*
+    Waits for the loader of the current buffer to stop, after
+    asking it to if cancel is set, and adds the rest of its rows
+    */
+    struct editorStream *st = buf->stream;
+    if (st == NULL) return;
+    if (cancel) atomic_store(&st->cancel, 1);
+
+    pthread_join(st->thread, NULL);
+    while (editorStreamTake(st));
+    int err = atomic_load(&st->err);
+    if (err) editorSetStatusMessage("Can't read input: %s", strerror(err));
+    free(st->head);
+    free(st);
+    buf->stream = NULL;
+}
+
+int editorStreamPoll() {
+    /*
+    Adds the next batch of lines the loader of the current buffer
+    has read as rows. Returns whether any were added or loading
+    ended
+    */
+    struct editorBuffer *buf = E.views[E.view].buf;
+    struct editorStream *st = buf->stream;
+    // Rows are added between scans, the workers walk the row tree
+    if (st == NULL || searchBusy(&E.search)) return 0;
+
+    int done = atomic_load_explicit(&st->done, memory_order_acquire);
+    if (editorStreamTake(st)) return 1;
+    if (!done) return 0;
+
+    editorStreamFinish(buf, 0);
+    return 1;
+}
+
+void editorOpen(char *filename, int fd) {
+    /*
+    Loads the contents of a file opened on fd into the editor in
+    the background. Regular files are memory-mapped and their rows
+    point into the mapping, other files are read into blocks
+    */
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            close(fd);
+            E.map = map;
+            E.maplen = st.st_size;
+            editorLoadStart(-1, map, st.st_size);
+            E.dirty = 0;
+            return;
+        }
+    }
+
+    editorLoadStart(fd, NULL, 0);
+    E.dirty = 0;
+}
+
+int editorWritev(int fd, struct iovec *iov, int n, long long *total) {
+    /*
+    Writes out a batch of iovecs, resuming after partial writes
+    */
+    int i = 0;
+    while (i < n) {
+        ssize_t r = writev(fd, &iov[i], n - i);
+        if (r == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        *total += r;
+
+        while (i < n && (size_t)r >= iov[i].iov_len) r -= iov[i++].iov_len;
+        if (i < n) {
+            iov[i].iov_base = (char *)iov[i].iov_base + r;
+            iov[i].iov_len -= r;
+        }
+    }
+    return 0;
+}
+
+int editorWriteRows(int fd, struct saveJob *job) {
+    /*
+    Streams the snapshot to a file with writev, the iovecs point
+    straight at each row's chars followed by a newline, so no
+    copy of the file is ever built
+    */
+    struct iovec iov[KAI_SAVE_IOV];
+    int n = 0;
+    long long written = 0;
+
+    for (int j = 0; j < job->numrows; j++) {
+        iov[n] = job->rows[j];
+        iov[n + 1].iov_base = "\n";
+        iov[n + 1].iov_len = 1;
+        n += 2;
+
+        if (n == KAI_SAVE_IOV || j == job->numrows - 1) {
+            if (editorWritev(fd, iov, n, &written) == -1) return -1;
+            n = 0;
+
+            pthread_mutex_lock(&job->lock);
+            job->written = written;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    return 0;
+}
+
+int editorWriteFile(struct saveJob *job) {
+    /*
+    Saves a snapshot to a temporary file next to the target, syncs it
+    and renames it into place, so a failed or interrupted save leaves
+    the old file intact. Rows still mapped from the old file stay
+    valid, the mapping keeps its contents alive.
+    Returns -1 with errno set on failure
+    */
+    char *path = realpath(job->filename, NULL);
+    if (path == NULL) path = strdup(job->filename);
+
+    char *tmp = malloc(strlen(path) + 12);
+    if (path == NULL || tmp == NULL) die("malloc");
+    sprintf(tmp, "%s.kaiXXXXXX", path);
+
+    // Keep the permissions of the file being replaced
+    struct stat st;
+    mode_t mode;
+    if (job->swap) {
+        mode = 0600;
+    } else if (stat(path, &st) == 0) {
+        mode = st.st_mode & 07777;
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0644 & ~mask;
+    }
+
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        free(tmp);
+        free(path);
+        return -1;
+    }
+
+    int ok = fchmod(fd, mode) == 0 && editorWriteRows(fd, job) == 0 &&
+        fsync(fd) == 0;
+    int saved = errno;
+    if (close(fd) == -1 && ok) {
+        ok = 0;
+        saved = errno;
+    }
+    if (ok && rename(tmp, path) == -1) saved = errno, ok = 0;
+
+    if (!ok) {
+        unlink(tmp);
+        free(tmp);
+        free(path);
+        errno = saved;
+        return -1;
+    }
+
+    // Make the rename itself durable
+    char *slash = strrchr(path, '/');
+    if (slash) *slash = '\0';
+    int dir = open(slash ? (slash == path ? "/" : path) : ".", O_RDONLY);
+    if (dir != -1) {
+        fsync(dir);
+        close(dir);
+    }
+
+    free(tmp);
+    free(path);
+    return 0;
+}
+
+void *editorSaveThread(void *arg) {
+    /*
+    Writer thread, flushes a snapshot to disk
+    */
+    struct saveJob *job = arg;
+    int err = (editorWriteFile(job) == -1) ? errno : 0;
+
+    pthread_mutex_lock(&job->lock);
+    job->err = err;
+    job->done = 1;
+    pthread_cond_signal(&job->finished);
+    pthread_mutex_unlock(&job->lock);
+    editorWake();
+    return NULL;
+}
+
+char *editorSwapName(char *filename) {
+    /*
+    Returns the name of the swap file autosaves of a file go to,
+    .name.kai~ next to it
+    */
+    char *slash = strrchr(filename, '/');
+    int dirlen = slash ? slash - filename + 1 : 0;
+
+    char *swap = malloc(strlen(filename) + 7);
+    if (swap == NULL) die("malloc");
+    sprintf(swap, "%.*s.%s.kai~", dirlen, filename, filename + dirlen);
+    return swap;
+}
+
+void editorSwapUnlink() {
+    /*
+    Removes the swap file of the current buffer, only if an autosave
+    of this session wrote it
+    */
+    if (!E.swapped || E.filename == NULL) return;
+    char *swap = editorSwapName(E.filename);
+    unlink(swap);
+    free(swap);
+    E.swapped = 0;
+}
+
+void editorSaveStart(char *filename, int swap) {
+    /*
+    Takes a snapshot of the rows and starts a writer thread on it.
+    The snapshot only copies pointers: mapped rows never change, and
+    heap rows are copied on their next edit instead of being changed
+    in place while the save holds them. An open gap is closed first
+    so that each row is written from a single buffer
+    */
+    editorCloseGap();
+    struct saveJob *job = calloc(1, sizeof(struct saveJob));
+    if (job == NULL) die("calloc");
+    job->filename = filename;
+    job->swap = swap;
+    job->dirty = E.dirty;
+    job->numrows = E.numrows;
+    job->rows = malloc(sizeof(struct iovec) * (E.numrows + 1));
+    if (job->rows == NULL) die("malloc");
+
+    E.save_gen++;
+    int j = 0;
+    for (erow *row = editorRowAt(0); row; row = rowtreeNext(row), j++) {
+        job->rows[j].iov_base = row->chars;
+        job->rows[j].iov_len = row->size;
+        job->total += row->size + 1;
+        row->snap = E.save_gen;
+    }
+
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->finished, NULL);
+    if (pthread_create(&job->thread, NULL, editorSaveThread, job) != 0)
+        die("pthread_create");
+    E.save = job;
+}
+
+int editorSavePoll() {
+    /*
+    Reports the progress of the running save in the status bar, and
+    its outcome once done. Also starts autosaves when they are due.
+    Returns whether the status message changed
+    */
+    struct saveJob *job = E.save;
+
+    if (job == NULL) {
+        if (E.autosave && E.filename && E.dirty && E.dirty != E.autosaved &&
+            !E.views[E.view].buf->stream && time(NULL) - E.autosave_time >= E.autosave) {
+            E.autosave_time = time(NULL);
+            E.swapped = 1;
+            editorSaveStart(editorSwapName(E.filename), 1);
+        }
+        return 0;
+    }
+
+    pthread_mutex_lock(&job->lock);
+    int done = job->done;
+    int err = job->err;
+    long long written = job->written;
+    pthread_mutex_unlock(&job->lock);
+
+    if (!done) {
+        if (job->swap) return 0;
+        editorSetStatusMessage("Saving... %d%%",
+            job->total ? (int)(written * 100 / job->total) : 0);
+        return 1;
+    }
+
+    pthread_join(job->thread, NULL);
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->finished);
+    E.save = NULL;
+
+    if (job->swap) {
+        if (err) editorSetStatusMessage("Autosave failed: %s", strerror(err));
+        else E.autosaved = job->dirty;
+    } else if (err) {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(err));
+    } else {
+        editorSetStatusMessage("%lld bytes written to disk", written);
+        if (E.dirty == job->dirty) E.dirty = 0;
+        E.autosaved = 0;
+        editorSwapUnlink();
+
+        // The file was renamed into place, it is a new inode now
+        struct stat st;
+        struct editorBuffer *buf = E.views[E.view].buf;
+        if (stat(E.filename, &st) == 0) {
+            buf->dev = st.st_dev;
+            buf->ino = st.st_ino;
+        }
+    }
+
+    for (int j = 0; j < job->ndeferred; j++)
+        slabFree(&E.slab, job->deferred[j].iov_base, job->deferred[j].iov_len);
+    free(job->deferred);
+    free(job->rows);
+    free(job->filename);
+    free(job);
+    return 1;
+}
+
+void editorSaveWait() {
+    /*
+    Waits for the running save to finish
+    */
+    struct saveJob *job = E.save;
+    if (job == NULL) return;
+
+    pthread_mutex_lock(&job->lock);
+    while (!job->done) pthread_cond_wait(&job->finished, &job->lock);
+    pthread_mutex_unlock(&job->lock);
+    editorSavePoll();
+}
+
+void editorSave() {
+    /*
+    General save function, saves current open file
+    or prompts the user to save as a new file.
+    The file is written in the background
+    */
+    if (E.save && !E.save->swap) {
+        editorSetStatusMessage("Still saving, try again when done");
+        return;
+    }
+    if (E.views[E.view].buf->stream) {
+        editorSetStatusMessage("Still loading, try again when done");
+        return;
+    }
+
+    if (E.filename == NULL) {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+        if (E.filename == NULL) {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+
+        editorSelectSyntaxHighlight();
+    }
+
+    editorSaveWait();
+    editorSaveStart(strdup(E.filename), 0);
+    editorSavePoll();
 }
 
-void editorInsertNewline() {
-    if (E.cx == 0) {
-        editorInsertRow(E.cy, "", 0);
+struct editorBuffer *editorBufferNew() {
+    /*
+    Allocates an empty buffer
+    */
+    struct editorBuffer *buf = calloc(1, sizeof(struct editorBuffer));
+    if (buf == NULL) die("calloc");
+    buf->rows.root = rowtreeNewNode(1);
+    buf->gaprow = -1;
+    buf->follow_fd = buf->follow_wd = -1;
+    return buf;
+}
+
+void editorBufferStore(struct editorBuffer *buf) {
+    /*
+    Moves the state of the current buffer from E into its own
+    struct, only pointers and counters are copied
+    */
+    buf->numrows = E.numrows;
+    buf->rows = E.rows;
+    buf->dirty = E.dirty;
+    buf->map = E.map;
+    buf->maplen = E.maplen;
+    buf->filename = E.filename;
+    buf->syntax = E.syntax;
+    buf->hl_frontier = E.hl_frontier;
+    buf->gaprow = E.gaprow;
+    buf->undo = E.undo;
+    buf->autosaved = E.autosaved;
+    buf->swapped = E.swapped;
+}
+
+void editorBufferLoad(struct editorBuffer *buf) {
+    /*
+    Makes a buffer current by moving its state into E, the rows
+    keep the render and highlight they had
+    */
+    E.numrows = buf->numrows;
+    E.rows = buf->rows;
+    E.dirty = buf->dirty;
+    E.map = buf->map;
+    E.maplen = buf->maplen;
+    E.filename = buf->filename;
+    E.syntax = buf->syntax;
+    E.hl_frontier = buf->hl_frontier;
+    E.gaprow = buf->gaprow;
+    E.undo = buf->undo;
+    E.autosaved = buf->autosaved;
+    E.swapped = buf->swapped;
+}
+
+void editorViewStore() {
+    /*
+    Stores the cursor and buffer of the current view
+    */
+    struct editorView *v = &E.views[E.view];
+    v->cx = E.cx, v->cy = E.cy;
+    v->rx = E.rx;
+    v->rowoff = E.rowoff, v->coloff = E.coloff;
+    editorBufferStore(v->buf);
+}
+
+void editorViewLoad() {
+    /*
+    Loads the current view, its cursor is kept inside the buffer
+    which another view of it may have edited
+    */
+    struct editorView *v = &E.views[E.view];
+    editorBufferLoad(v->buf);
+    E.cx = v->cx, E.cy = v->cy;
+    E.rx = v->rx;
+    E.rowoff = v->rowoff, E.coloff = v->coloff;
+
+    if (E.cy > E.numrows) E.cy = E.numrows;
+    int len = E.cy < E.numrows ? editorRowAt(E.cy)->size : 0;
+    if (E.cx > len) E.cx = len;
+    if (E.rowoff > E.cy) E.rowoff = E.cy;
+}
+
+void editorSwitchView(int view) {
+    /*
+    Makes another view current. A save finishing updates the
+    current buffer, so a running one is waited for first
+    */
+    if (view == E.view) return;
+    editorSaveWait();
+    editorViewStore();
+    E.view = view;
+    editorViewLoad();
+}
+
+int editorAddView(struct editorBuffer *buf) {
+    /*
+    Adds a view of a buffer and returns its index
+    */
+    E.views = realloc(E.views, sizeof(struct editorView) * (E.nviews + 1));
+    if (E.views == NULL) die("realloc");
+
+    struct editorView *v = &E.views[E.nviews];
+    memset(v, 0, sizeof(*v));
+    v->buf = buf;
+    buf->nviews++;
+    return E.nviews++;
+}
+
+int editorOpenBuffer(char *filename) {
+    /*
+    Opens a file in a new view. A file open already is shown by
+    a second view sharing its rows instead of being read again,
+    and an empty unnamed buffer is reused.
+    Returns -1 if the file can't be opened
+    */
+    // Opened before any buffer is made, so a file that can't be read
+    // leaves the other buffers alone
+    struct stat st;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        editorSetStatusMessage("Can't open %s: %s", filename, strerror(errno));
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    for (int j = 0; j < E.nviews; j++) {
+        struct editorBuffer *buf = E.views[j].buf;
+        if (buf->ino && buf->dev == st.st_dev && buf->ino == st.st_ino) {
+            close(fd);
+            editorSwitchView(editorAddView(buf));
+            return 0;
+        }
+    }
+
+    struct editorBuffer *buf = E.views[E.view].buf;
+    if (E.filename || E.numrows || E.dirty) {
+        buf = editorBufferNew();
+        editorSwitchView(editorAddView(buf));
+    }
+    editorOpen(filename, fd);
+    buf->dev = st.st_dev;
+    buf->ino = st.st_ino;
+    return 0;
+}
+
+void editorFollowStop(struct editorBuffer *buf);
+
+void editorCloseView() {
+    /*
+    Closes the current view and shows the next one, the buffer
+    is freed along with its last view
+    */
+    if (E.nviews == 1) {
+        editorSetStatusMessage("No other buffer open");
+        return;
+    }
+
+    struct editorBuffer *buf = E.views[E.view].buf;
+    if (buf->nviews == 1) editorStreamFinish(buf, 1);
+    editorSaveWait();
+    if (--buf->nviews == 0) {
+        editorFollowStop(buf);
+        editorSwapUnlink();
+
+        E.undo.replay = 1;
+        editorDelRows(0, E.numrows);
+        rowtreeFreeNode(E.rows.root);
+        if (E.map) munmap(E.map, E.maplen);
+        free(E.filename);
+        free(E.undo.recs);
+        abufFree(&E.undo.text);
+        free(buf);
     } else {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
+        editorBufferStore(buf);
+    }
+
+    memmove(&E.views[E.view], &E.views[E.view + 1],
+        sizeof(struct editorView) * (E.nviews - E.view - 1));
+    E.nviews--;
+    if (E.view == E.nviews) E.view = 0;
+    editorViewLoad();
+}
 
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
+int editorAnyDirty() {
+    /*
+    Returns whether any open buffer has unsaved changes
+    */
+    if (E.dirty) return 1;
+    for (int j = 0; j < E.nviews; j++)
+        if (j != E.view && E.views[j].buf != E.views[E.view].buf &&
+            E.views[j].buf->dirty)
+            return 1;
+    return 0;
+}
 
-        editorUpdateRow(row);
+void editorFollowEvents() {
+    /*
+    Takes the pending inotify events and marks the followed
+    buffers whose files grew, the current one is read in by
+    editorFollowPoll and the others once they are shown
+    */
+    char ev[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while ((n = read(E.inotifyfd, ev, sizeof(ev))) > 0) {
+        for (char *p = ev; p < ev + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *e = (struct inotify_event *)p;
+            for (int j = 0; j < E.nviews; j++)
+                if (E.views[j].buf->follow_wd == e->wd) E.views[j].buf->follow_pending = 1;
+        }
     }
+}
 
-    E.cy++;
-    E.cx = 0;
+void searchDropFrom(struct editorSearch *s, int at);
+void editorFollowMapDel(char *map);
+
+void editorFollowReset(struct editorBuffer *buf) {
+    /*
+    Drops every row of the current buffer and its undo journal, which
+    refers to them, so that the followed file is read in afresh
+    */
+    searchDropFrom(&E.search, 0);
+    editorFollowMapDel(E.map);
+    E.undo.replay = 1;
+    editorDelRows(0, E.numrows);
+    E.undo.replay = 0;
+    E.undo.nrecs = E.undo.pos = 0;
+    E.undo.text.len = 0;
+    E.undo.open = 0;
+    if (E.map) munmap(E.map, E.maplen);
+    E.map = NULL;
+    E.maplen = 0;
+    E.cx = E.cy = E.rowoff = E.coloff = 0;
+    buf->follow_tail = 0;
+    buf->follow_partial = 0;
 }
 
-void editorDelChar() {
-    if (E.cy == E.numrows) return;
-    if (E.cx == 0 && E.cy == 0) return;
+int editorFollowRead(struct editorBuffer *buf) {
+    /*
+    Appends the lines written to the followed file of the current
+    buffer since it was last read as rows at the end, only they
+    are rendered and highlighted. An unterminated last line is
+    shown as a row and read again once the rest of it is written.
+    Returns whether rows were added
+    */
+    struct stat st;
+    if (fstat(buf->follow_fd, &st) == -1) return 0;
+
+    // The cursor on the last row keeps the end of the file in view
+    int bottom = E.cy >= E.numrows - 1;
+    int dirty = E.dirty;
+    if (st.st_size < buf->follow_tail) {
+        // The rows are stale and are read again from the start
+        editorSetStatusMessage("%s: file truncated", E.filename);
+        editorFollowReset(buf);
+        bottom = 1;
+        dirty = 0;
+    }
+    if (st.st_size == buf->follow_tail) return 0;
+
+    if (buf->follow_partial) {
+        searchDropFrom(&E.search, E.numrows - 1);
+        E.undo.replay = 1;
+        editorDelRows(E.numrows - 1, 1);
+        E.undo.replay = 0;
+        buf->follow_partial = 0;
+    }
 
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
+    static char block[KAI_FOLLOW_BLOCK];
+    struct abuf line = ABUF_INIT;
+    off_t off = buf->follow_tail;
+    while (off < st.st_size) {
+        size_t want = st.st_size - off < KAI_FOLLOW_BLOCK ? st.st_size - off : KAI_FOLLOW_BLOCK;
+        ssize_t n = pread(buf->follow_fd, block, want, off);
+        if (n <= 0) break;
+        off += n;
+
+        char *p = block, *end = block + n, *nl;
+        while ((nl = memchr(p, '\n', end - p)) != NULL) {
+            char *s = p;
+            int len = nl - p;
+            if (line.len) {
+                abufAppend(&line, p, len);
+                s = line.b, len = line.len;
+            }
+            while (len > 0 && s[len - 1] == '\r') len--;
+            editorLoadRow(slabLoad(&E.slab, s, len), len);
+            line.len = 0;
+            p = nl + 1;
+        }
+        if (p < end) abufAppend(&line, p, end - p);
+        buf->follow_tail = off - line.len;
+    }
+    if (line.len) {
+        editorLoadRow(slabLoad(&E.slab, line.b, line.len), line.len);
+        buf->follow_partial = 1;
+    }
+    abufFree(&line);
+    E.dirty = dirty;
+
+    if (bottom) {
+        E.cy = E.numrows ? E.numrows - 1 : 0;
+        E.cx = 0;
+    }
+    return 1;
+}
+
+int editorFollowPoll() {
+    /*
+    Reads in what was written to the current buffer's file if it
+    is followed and has grown. Returns whether it had
+    */
+    struct editorBuffer *buf = E.views[E.view].buf;
+    // Appending waits until the rows loaded so far are all in, and
+    // for the search workers walking the rows
+    if (!buf->follow_pending || buf->stream || searchBusy(&E.search)) return 0;
+    buf->follow_pending = 0;
+    return editorFollowRead(buf);
+}
+
+void editorFollowStop(struct editorBuffer *buf) {
+    /*
+    Stops following the file of a buffer
+    */
+    if (buf->follow_fd == -1) return;
+    editorFollowMapDel(buf == E.views[E.view].buf ? E.map : buf->map);
+    inotify_rm_watch(E.inotifyfd, buf->follow_wd);
+    close(buf->follow_fd);
+    buf->follow_fd = buf->follow_wd = -1;
+}
+
+void editorHandleBus(int sig, siginfo_t *si, void *ctx) {
+    /*
+    Maps a page of zeros over a page of a followed file's mapping
+    that a truncation took away, the access that faulted then reads
+    NULs until the truncation is noticed and the rows are read again.
+    Other faults are left to the default action
+    */
+    (void)ctx;
+    uintptr_t at = (uintptr_t)si->si_addr;
+    for (int j = 0; j < KAI_FOLLOW_MAPS; j++) {
+        uintptr_t lo = atomic_load(&follow_maps[j].lo);
+        if (lo == 0 || at < lo || at >= atomic_load(&follow_maps[j].hi)) continue;
+
+        void *page = (void *)(at & ~(uintptr_t)(follow_pagesize - 1));
+        if (mmap(page, follow_pagesize, PROT_READ,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED)
+            return;
+        break;
+    }
+    signal(sig, SIG_DFL);
+}
+
+int editorFollowMapAdd(char *map, size_t len) {
+    /*
+    Lets the SIGBUS handler patch up the mapping of a followed file,
+    so that a copytruncate doesn't bring the editor down while the
+    rows still point into it. Returns -1 if no slot is free
+    */
+    for (int j = 0; j < KAI_FOLLOW_MAPS; j++) {
+        if (atomic_load(&follow_maps[j].lo) != 0) continue;
+        atomic_store(&follow_maps[j].hi, (uintptr_t)map + len);
+        atomic_store(&follow_maps[j].lo, (uintptr_t)map);
+        return 0;
+    }
+    return -1;
+}
+
+void editorFollowMapDel(char *map) {
+    /*
+    Stops patching up the mapping of a file no longer followed
+    */
+    for (int j = 0; j < KAI_FOLLOW_MAPS; j++)
+        if (map && atomic_load(&follow_maps[j].lo) == (uintptr_t)map)
+            atomic_store(&follow_maps[j].lo, 0);
+}
+
+void editorFollowStart() {
+    /*
+    Follows the file of the current buffer like tail -f, inotify
+    tells when it grows. Reading picks up after the last whole line
+    of its mapping
+    */
+    struct editorBuffer *buf = E.views[E.view].buf;
+    if (buf->follow_fd != -1) return;
+
+    struct stat st;
+    int fd = E.filename ? open(E.filename, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        editorSetStatusMessage("Can't follow %s", E.filename ? E.filename : "[No Name]");
+        if (fd != -1) close(fd);
+        return;
+    }
+
+    if (E.inotifyfd == -1) {
+        E.inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (E.inotifyfd == -1) die("inotify_init1");
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = editorHandleBus;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        follow_pagesize = sysconf(_SC_PAGESIZE);
+        if (sigaction(SIGBUS, &sa, NULL) == -1) die("sigaction");
+    }
+    if (E.map && editorFollowMapAdd(E.map, E.maplen) == -1) {
+        editorSetStatusMessage("Can't follow more than %d files", KAI_FOLLOW_MAPS);
+        close(fd);
+        return;
+    }
+    int wd = inotify_add_watch(E.inotifyfd, E.filename, IN_MODIFY);
+    if (wd == -1) {
+        editorSetStatusMessage("Can't follow %s: %s", E.filename, strerror(errno));
+        editorFollowMapDel(E.map);
+        close(fd);
+        return;
+    }
+
+    buf->follow_fd = fd;
+    buf->follow_wd = wd;
+    if (E.map) {
+        char *nl = memrchr(E.map, '\n', E.maplen);
+        buf->follow_tail = nl ? nl - E.map + 1 : 0;
+        buf->follow_partial = buf->follow_tail < (off_t)E.maplen;
     } else {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+        buf->follow_tail = E.numrows ? st.st_size : 0;
+        buf->follow_partial = 0;
+    }
+    buf->follow_pending = 1;
+}
+
+void editorFollowToggle() {
+    /*
+    Starts or stops following the file of the current buffer
+    */
+    struct editorBuffer *buf = E.views[E.view].buf;
+    if (buf->follow_fd == -1) editorFollowStart();
+    else editorFollowStop(buf);
+}
+
+void editorOpenStream(int fd) {
+    /*
+    Shows the input read from a pipe in a buffer of its own while
+    the loader keeps adding to it
+    */
+    if (E.filename || E.numrows || E.dirty) editorSwitchView(editorAddView(editorBufferNew()));
+    editorLoadStart(fd, NULL, 0);
+}
+
+int editorTakeStdin() {
+    /*
+    Moves piped input off stdin, which is opened again on the
+    terminal for the keys. Returns the input or -1 if stdin is
+    the terminal
+    */
+    if (isatty(STDIN_FILENO)) return -1;
+
+    int fd = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+    if (fd == -1 || tty == -1) die("open");
+    if (dup2(tty, STDIN_FILENO) == -1) die("dup2");
+    close(tty);
+    return fd;
+}
+
+int regexNewNode(struct regexParser *rp, int type, int l, int r) {
+    /*
+    Adds a node to the syntax tree of the pattern being parsed
+    */
+    struct regexNode *nd = &rp->nodes[rp->n];
+    nd->type = type;
+    nd->l = l;
+    nd->r = r;
+    nd->cls = -1;
+    return rp->n++;
+}
+
+int regexNewClass(struct regexParser *rp) {
+    /*
+    Adds an empty byte set to the program and returns a class node
+    matching it
+    */
+    struct regexProg *g = rp->prog;
+    memset(g->classes[g->nclasses], 0, 32);
+    int i = regexNewNode(rp, RN_CLASS, -1, -1);
+    rp->nodes[i].cls = g->nclasses++;
+    return i;
+}
+
+void regexClassAdd(unsigned char *cls, int lo, int hi) {
+    for (int c = lo; c <= hi; c++) cls[c >> 3] |= 1 << (c & 7);
+}
+
+int regexClassEscape(unsigned char *cls, int ch) {
+    /*
+    Adds the bytes of a backslash escape to a byte set, returns
+    0 if the escape is a plain character to be taken literally
+    */
+    unsigned char set[32] = {0};
+    switch (tolower(ch)) {
+        case 'd':
+            regexClassAdd(set, '0', '9');
+            break;
+        case 'w':
+            regexClassAdd(set, '0', '9');
+            regexClassAdd(set, 'a', 'z');
+            regexClassAdd(set, 'A', 'Z');
+            regexClassAdd(set, '_', '_');
+            break;
+        case 's':
+            regexClassAdd(set, ' ', ' ');
+            regexClassAdd(set, '\t', '\r');
+            break;
+        case 't':
+            if (ch == 'T') return 0;
+            regexClassAdd(cls, '\t', '\t');
+            return 1;
+        default:
+            return 0;
+    }
+
+    for (int j = 0; j < 32; j++) cls[j] |= isupper(ch) ? ~set[j] : set[j];
+    return 1;
+}
+
+int regexParseAlt(struct regexParser *rp);
+
+int regexParseAtom(struct regexParser *rp) {
+    /*
+    Parses a single character, class, anchor or group,
+    returns -1 on a syntax error
+    */
+    int ch = (unsigned char)*rp->p++;
+    int i;
+    unsigned char *cls;
+
+    switch (ch) {
+        case '(':
+            i = regexParseAlt(rp);
+            if (i == -1 || *rp->p != ')') return -1;
+            rp->p++;
+            return i;
+        case '^':
+            return regexNewNode(rp, RN_BOL, -1, -1);
+        case '$':
+            return regexNewNode(rp, RN_EOL, -1, -1);
+        case '.':
+            i = regexNewClass(rp);
+            memset(rp->prog->classes[rp->nodes[i].cls], 0xff, 32);
+            return i;
+        case '*':
+        case '+':
+        case '?':
+            return -1;
+        case '\\':
+            ch = (unsigned char)*rp->p++;
+            if (ch == '\0') return -1;
+            i = regexNewClass(rp);
+            cls = rp->prog->classes[rp->nodes[i].cls];
+            if (!regexClassEscape(cls, ch)) regexClassAdd(cls, ch, ch);
+            return i;
+        case '[':
+            break;
+        default:
+            i = regexNewClass(rp);
+            regexClassAdd(rp->prog->classes[rp->nodes[i].cls], ch, ch);
+            return i;
+    }
+
+    // Bracket expression, a leading ] is taken literally
+    i = regexNewClass(rp);
+    cls = rp->prog->classes[rp->nodes[i].cls];
+    int negate = (*rp->p == '^');
+    if (negate) rp->p++;
+
+    const char *first = rp->p;
+    while (*rp->p != ']' || rp->p == first) {
+        int lo = (unsigned char)*rp->p++;
+        if (lo == '\0') return -1;
+        if (lo == '\\') {
+            lo = (unsigned char)*rp->p++;
+            if (lo == '\0') return -1;
+            if (regexClassEscape(cls, lo)) continue;
+        }
+
+        int hi = lo;
+        if (rp->p[0] == '-' && rp->p[1] != ']' && rp->p[1] != '\0') {
+            hi = (unsigned char)rp->p[1];
+            rp->p += 2;
+            if (hi < lo) return -1;
+        }
+        regexClassAdd(cls, lo, hi);
+    }
+    rp->p++;
+
+    if (negate) for (int j = 0; j < 32; j++) cls[j] = ~cls[j];
+    return i;
+}
+
+int regexParseRepeat(struct regexParser *rp) {
+    /*
+    Parses an atom followed by any number of *, + and ? operators
+    */
+    int i = regexParseAtom(rp);
+    while (i != -1) {
+        int type;
+        switch (*rp->p) {
+            case '*': type = RN_STAR; break;
+            case '+': type = RN_PLUS; break;
+            case '?': type = RN_QUEST; break;
+            default: return i;
+        }
+        rp->p++;
+        i = regexNewNode(rp, type, i, -1);
+    }
+    return i;
+}
+
+int regexParseAlt(struct regexParser *rp) {
+    /*
+    Parses alternatives separated by |, each a sequence of
+    repeated atoms, up to the end of the pattern or group
+    */
+    int alt = -1;
+    while (1) {
+        int cat = -1;
+        while (*rp->p && *rp->p != '|' && *rp->p != ')') {
+            int i = regexParseRepeat(rp);
+            if (i == -1) return -1;
+            cat = (cat == -1) ? i : regexNewNode(rp, RN_CAT, cat, i);
+        }
+        if (cat == -1) cat = regexNewNode(rp, RN_EMPTY, -1, -1);
+
+        alt = (alt == -1) ? cat : regexNewNode(rp, RN_ALT, alt, cat);
+        if (*rp->p != '|') return alt;
+        rp->p++;
+    }
+}
+
+void regexEmit(struct regexProg *g, struct regexNode *nodes, int i) {
+    /*
+    Appends the NFA instructions of a syntax tree node to the program
+    */
+    struct regexNode *nd = &nodes[i];
+    struct regexInst *in = g->inst;
+    int pc, jmp;
+
+    switch (nd->type) {
+        case RN_CLASS:
+            in[g->n] = (struct regexInst){ RE_CHAR, g->n + 1, 0, nd->cls };
+            g->n++;
+            break;
+        case RN_BOL:
+        case RN_EOL:
+            in[g->n] = (struct regexInst){
+                (nd->type == RN_BOL) ? RE_BOL : RE_EOL, g->n + 1, 0, -1 };
+            g->n++;
+            break;
+        case RN_EMPTY:
+            break;
+        case RN_CAT:
+            regexEmit(g, nodes, nd->l);
+            regexEmit(g, nodes, nd->r);
+            break;
+        case RN_ALT:
+            pc = g->n++;
+            regexEmit(g, nodes, nd->l);
+            jmp = g->n++;
+            in[pc] = (struct regexInst){ RE_SPLIT, pc + 1, g->n, -1 };
+            regexEmit(g, nodes, nd->r);
+            in[jmp] = (struct regexInst){ RE_JMP, g->n, 0, -1 };
+            break;
+        case RN_STAR:
+            pc = g->n++;
+            regexEmit(g, nodes, nd->l);
+            in[g->n] = (struct regexInst){ RE_JMP, pc, 0, -1 };
+            g->n++;
+            in[pc] = (struct regexInst){ RE_SPLIT, pc + 1, g->n, -1 };
+            break;
+        case RN_PLUS:
+            pc = g->n;
+            regexEmit(g, nodes, nd->l);
+            in[g->n] = (struct regexInst){ RE_SPLIT, pc, g->n + 1, -1 };
+            g->n++;
+            break;
+        case RN_QUEST:
+            pc = g->n++;
+            regexEmit(g, nodes, nd->l);
+            in[pc] = (struct regexInst){ RE_SPLIT, pc + 1, g->n, -1 };
+            break;
+    }
+}
+
+void regexFree(struct regexProg *g) {
+    if (g == NULL) return;
+    free(g->inst);
+    free(g->classes);
+    free(g);
+}
+
+struct regexProg *regexCompile(const char *pattern) {
+    /*
+    Compiles a pattern into a Thompson NFA, returns NULL if the
+    pattern is not valid. Supports literals, ., [] classes, the
+    \d \w \s escapes, ^ and $ anchors, groups, |, *, + and ?
+    */
+    int len = strlen(pattern);
+    struct regexProg *g = malloc(sizeof(struct regexProg));
+    if (g == NULL) die("malloc");
+
+    // Every byte of the pattern adds at most two nodes, and every
+    // node at most two instructions
+    struct regexParser rp = { pattern, NULL, 0, g };
+    rp.nodes = malloc(sizeof(struct regexNode) * (2 * len + 2));
+    g->classes = malloc(32 * (len + 1));
+    g->inst = malloc(sizeof(struct regexInst) * (4 * len + 5));
+    g->n = g->nclasses = 0;
+    if (rp.nodes == NULL || g->classes == NULL || g->inst == NULL) die("malloc");
+
+    int root = regexParseAlt(&rp);
+    if (root == -1 || *rp.p != '\0') {
+        free(rp.nodes);
+        regexFree(g);
+        return NULL;
+    }
+
+    regexEmit(g, rp.nodes, root);
+    g->inst[g->n++] = (struct regexInst){ RE_MATCH, 0, 0, -1 };
+    free(rp.nodes);
+    return g;
+}
+
+void regexInit(struct regexDFA *d, struct regexProg *g, int any) {
+    /*
+    Sets up an empty lazy DFA for a program, its states are built
+    the first time the search reaches them
+    */
+    d->prog = g;
+    d->any = any;
+    d->states = NULL;
+    d->sets = NULL;
+    d->nstates = d->cap = d->nsets = d->setcap = 0;
+    memset(d->hash, 0, sizeof(d->hash));
+    d->mark = calloc(g->n, sizeof(int));
+    d->stack = malloc(sizeof(int) * (2 * g->n + 2));
+    d->work = malloc(sizeof(int) * g->n);
+    if (d->mark == NULL || d->stack == NULL || d->work == NULL) die("malloc");
+    d->gen = 0;
+    d->start[0] = d->start[1] = -1;
+    d->flushes = 0;
+}
+
+void regexDFAFree(struct regexDFA *d) {
+    free(d->states);
+    free(d->sets);
+    free(d->mark);
+    free(d->stack);
+    free(d->work);
+}
+
+void regexClosure(struct regexDFA *d, int pc, int bol) {
+    /*
+    Adds an instruction and everything reachable from it without
+    consuming input to the set being built
+    */
+    int sp = 0;
+    d->stack[sp++] = pc;
+    while (sp) {
+        pc = d->stack[--sp];
+        if (d->mark[pc] == d->gen) continue;
+        d->mark[pc] = d->gen;
+
+        struct regexInst *in = &d->prog->inst[pc];
+        switch (in->op) {
+            case RE_JMP:
+                d->stack[sp++] = in->x;
+                break;
+            case RE_SPLIT:
+                d->stack[sp++] = in->y;
+                d->stack[sp++] = in->x;
+                break;
+            case RE_BOL:
+                if (bol) d->stack[sp++] = in->x;
+                break;
+            default:
+                d->work[d->nwork++] = pc;
+        }
+    }
+}
+
+int regexIntCmp(const void *a, const void *b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+int regexAddState(struct regexDFA *d) {
+    /*
+    Returns the state for the set just built, adding it if it is new.
+    A full cache is flushed, invalidating every earlier state index
+    */
+    qsort(d->work, d->nwork, sizeof(int), regexIntCmp);
+
+    unsigned int h = 2166136261u;
+    for (int j = 0; j < d->nwork; j++) h = (h ^ d->work[j]) * 16777619u;
+
+    unsigned int mask = 2 * KAI_REGEX_STATES - 1;
+    unsigned int slot;
+    for (slot = h & mask; d->hash[slot]; slot = (slot + 1) & mask) {
+        struct regexState *st = &d->states[d->hash[slot] - 1];
+        if (st->n == d->nwork &&
+            memcmp(&d->sets[st->off], d->work, sizeof(int) * d->nwork) == 0)
+            return d->hash[slot] - 1;
+    }
+
+    if (d->nstates == KAI_REGEX_STATES) {
+        d->nstates = d->nsets = 0;
+        memset(d->hash, 0, sizeof(d->hash));
+        d->start[0] = d->start[1] = -1;
+        d->flushes++;
+        slot = h & mask;
+    }
+
+    if (d->nstates == d->cap) {
+        d->cap = d->cap ? d->cap * 2 : 16;
+        d->states = realloc(d->states, sizeof(struct regexState) * d->cap);
+        if (d->states == NULL) die("realloc");
+    }
+    if (d->nsets + d->nwork > d->setcap) {
+        d->setcap = (d->nsets + d->nwork) * 2;
+        d->sets = realloc(d->sets, sizeof(int) * d->setcap);
+        if (d->sets == NULL) die("realloc");
+    }
+
+    struct regexState *st = &d->states[d->nstates];
+    memset(st->trans, -1, sizeof(st->trans));
+    st->off = d->nsets;
+    st->n = d->nwork;
+    st->accept = 0;
+    for (int j = 0; j < d->nwork; j++)
+        if (d->prog->inst[d->work[j]].op == RE_MATCH) st->accept = 1;
+    memcpy(&d->sets[d->nsets], d->work, sizeof(int) * d->nwork);
+    d->nsets += d->nwork;
+
+    d->hash[slot] = ++d->nstates;
+    return d->nstates - 1;
+}
+
+int regexStart(struct regexDFA *d, int bol) {
+    /*
+    Returns the state a match starts in, at the start of the row or not
+    */
+    if (d->start[bol] == -1) {
+        d->gen++;
+        d->nwork = 0;
+        regexClosure(d, 0, bol);
+        int s = regexAddState(d);
+        d->start[bol] = s;
+    }
+    return d->start[bol];
+}
+
+int regexStep(struct regexDFA *d, int s, int c) {
+    /*
+    Returns the state after reading a byte, or the end of the row
+    as KAI_REGEX_EOL, building it on first use
+    */
+    int t = d->states[s].trans[c];
+    if (t >= 0) return t;
+
+    d->gen++;
+    d->nwork = 0;
+    struct regexState *st = &d->states[s];
+    for (int j = 0; j < st->n; j++) {
+        struct regexInst *in = &d->prog->inst[d->sets[st->off + j]];
+        if (in->op == RE_CHAR && c != KAI_REGEX_EOL &&
+            (d->prog->classes[in->cls][c >> 3] & (1 << (c & 7))))
+            regexClosure(d, in->x, 0);
+        else if (in->op == RE_EOL && c == KAI_REGEX_EOL)
+            regexClosure(d, in->x, 0);
     }
+    if (d->any && c != KAI_REGEX_EOL) regexClosure(d, 0, 0);
+
+    // A flush drops the state we came from, leave it unlinked
+    int flushes = d->flushes;
+    t = regexAddState(d);
+    if (d->flushes == flushes) d->states[s].trans[c] = t;
+    return t;
 }
 
-void editorScroll() {
-    E.rx = 0;
-    if (E.cy < E.numrows) {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+int regexFirstEnd(struct regexDFA *any, const char *p, int len, int from) {
+    /*
+    Returns where the earliest match starting at or after from ends,
+    or -1 if there is none
+    */
+    int s = regexStart(any, from == 0);
+    if (any->states[s].accept) return from;
+
+    for (int j = from; j < len; j++) {
+        unsigned char c = p[j];
+        int t = any->states[s].trans[c];
+        s = (t >= 0) ? t : regexStep(any, s, c);
+        if (any->states[s].accept) return j + 1;
     }
+    s = regexStep(any, s, KAI_REGEX_EOL);
+    return any->states[s].accept ? len : -1;
+}
 
-    if (E.cy < E.rowoff) {
-        E.rowoff = E.cy;
-    }
-    if (E.cy >= E.rowoff + E.screenrows) {
-        E.rowoff = E.cy - E.screenrows + 1;
-    }
-    if (E.rx < E.coloff) {
-        E.coloff = E.rx;
+int regexMatchAt(struct regexDFA *anch, const char *p, int len, int from) {
+    /*
+    Returns where the longest match starting at from ends, or -1
+    */
+    int s = regexStart(anch, from == 0);
+    int end = anch->states[s].accept ? from : -1;
+
+    int j;
+    for (j = from; j < len && anch->states[s].n; j++) {
+        s = regexStep(anch, s, (unsigned char)p[j]);
+        if (anch->states[s].accept) end = j + 1;
     }
-    if (E.rx >= E.coloff + E.screencols) {
-        E.coloff = E.rx - E.screencols + 1;
+    if (j == len && anch->states[s].n) {
+        s = regexStep(anch, s, KAI_REGEX_EOL);
+        if (anch->states[s].accept) end = len;
     }
+    return end;
 }
 
-void editorDrawRows(struct abuf *ab) {
+void searchCompile(struct editorSearch *s, char *query) {
     /*
-    Draws tilda characters at the end of input
-    to represent the editor screen,
-    draws the welcome message at the center of the screen
+    Sets the query of a search and builds its Horspool shift table,
+    or its NFA in regular expression mode
     */
-    for (int i = 0; i < E.screenrows; i++) {
-        int filerow = i + E.rowoff;
-        if (filerow >= E.numrows) {
-            if (E.numrows == 0 && i == E.screenrows / 3) {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome),
-                    "Kai editor -- version %s", KAI_VERSION);
-                
-                if (welcomelen > E.screencols) welcomelen = E.screencols;
-
-                int padding = (E.screencols - welcomelen) / 2;
-                if (padding) {
-                    abufAppend(ab, "~", 1);
-                    padding--;
-                }
+    free(s->query);
+    s->query = strdup(query);
+    s->qlen = strlen(query);
 
-                while (padding--) abufAppend(ab, " ", 1);
-                abufAppend(ab, welcome, welcomelen);
-            } else {
-                abufAppend(ab, "~", 1);
-            }
-        } else {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0) len = 0;
+    regexFree(s->prog);
+    s->prog = (s->regex && s->qlen) ? regexCompile(query) : NULL;
 
-            if (len > E.screencols) len = E.screencols;
+    for (int c = 0; c < 256; c++) s->skip[c] = s->qlen;
+    for (int j = 0; j < s->qlen - 1; j++)
+        s->skip[(unsigned char)s->query[j]] = s->qlen - 1 - j;
+}
 
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            int current_color = -1;
-            for (int j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-
-                    abufAppend(ab, "\x1b[7m", 4);
-                    abufAppend(ab, &sym, 1);
-                    abufAppend(ab, "\x1b[m", 3);
-                    if (current_color != -1) {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-                        abufAppend(ab, buf, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        abufAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
+const char *searchNext(struct editorSearch *s, const char *p, const char *end) {
+    /*
+    Returns the first occurrence of the query in the range,
+    or NULL. Short queries filter on their first byte with memchr,
+    longer ones skip ahead with Horspool's bad character rule
+    */
+    int qlen = s->qlen;
+    const char *q = s->query;
 
-                    abufAppend(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (current_color != color) {
-                        current_color = color;
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-                        
-                        abufAppend(ab, buf, clen);
-                    }
+    if (qlen == 0) return NULL;
 
-                    abufAppend(ab, &c[j], 1);
-                }
-            }
-            abufAppend(ab, "\x1b[39m", 5);
+    if (qlen < 4) {
+        while (end - p >= qlen) {
+            p = memchr(p, q[0], end - p - qlen + 1);
+            if (p == NULL) return NULL;
+            if (memcmp(p + 1, q + 1, qlen - 1) == 0) return p;
+            p++;
         }
+        return NULL;
+    }
 
-        abufAppend(ab, "\x1b[K", 3);
-        abufAppend(ab, "\r\n", 2);
+    unsigned char last = q[qlen - 1];
+    while (end - p >= qlen) {
+        unsigned char c = p[qlen - 1];
+        if (c == last && memcmp(p, q, qlen - 1) == 0) return p;
+        p += s->skip[c];
     }
+    return NULL;
 }
 
-void editorDrawMessageBar(struct abuf *ab) {
+void searchAdd(struct searchChunk *c, int row, int col, int len) {
     /*
-    Draws the message bar at the bottom of the screen
+    Appends a match to the matches of a chunk
     */
-    abufAppend(ab, "\x1b[K", 3);
-
-    int msglen = strlen(E.statusmsg);
-    if (msglen > E.screencols) msglen = E.screencols;
-
-    if (msglen && time(NULL) - E.statusmsg_time < 5)
-        abufAppend(ab, E.statusmsg, msglen);
+    if (c->count == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 64;
+        c->matches = realloc(c->matches, sizeof(struct searchMatch) * c->cap);
+        if (c->matches == NULL) die("realloc");
+    }
+    c->matches[c->count].row = row;
+    c->matches[c->count].col = col;
+    c->matches[c->count].len = len;
+    c->count++;
 }
 
-void editorDrawStatusBar(struct abuf *ab) {
+void searchRegexChunk(struct editorSearch *s, struct searchChunk *c) {
     /*
-    Draws the status bar at the bottom of the screen
+    Collects the leftmost longest matches of the pattern in each row
+    of a chunk. An empty match only counts as the first one of its row
     */
-    abufAppend(ab, "\x1b[7m", 4);
-
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-        E.filename ? E.filename : "[No Name]", E.numrows,
-        E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d:%d/%d",
-        E.syntax ? E.syntax->filetype : "no ft",
-        E.cy + 1, E.cx + 1, E.numrows);
-    
-    if (len > E.screencols) len = E.screencols;
-
-    abufAppend(ab, status, len);
+    struct regexDFA any, anch;
+    regexInit(&any, s->prog, 1);
+    regexInit(&anch, s->prog, 0);
+
+    erow *row = c->first;
+    for (int at = c->start; at < c->start + c->n; at++, row = rowtreeNext(row)) {
+        int found = 0;
+        int i = 0;
+        while (i <= row->size) {
+            int e = regexFirstEnd(&any, row->chars, row->size, i);
+            if (e == -1) break;
+
+            int j, end = -1;
+            for (j = i; j <= e; j++) {
+                end = regexMatchAt(&anch, row->chars, row->size, j);
+                if (end != -1) break;
+            }
+            if (end == -1) break;
 
-    while (len < E.screencols) {
-        if (E.screencols - len == rlen) {
-            abufAppend(ab, rstatus, rlen);
-            break;
-        } else {
-            abufAppend(ab, " ", 1);
-            len++;
+            if (end > j || !found) searchAdd(c, at, j, end - j);
+            found = 1;
+            i = (end > j) ? end : j + 1;
         }
     }
-    abufAppend(ab, "\x1b[m", 3);
-    abufAppend(ab, "\r\n", 2);
+
+    regexDFAFree(&any);
+    regexDFAFree(&anch);
 }
 
-void editorRefreshScreen() {
+void searchScanChunk(struct editorSearch *s, struct searchChunk *c) {
     /*
-    Refreshes the screen by clearing it and redrawing the
-    editor contents
+    Collects every match of the query in the rows of a chunk.
+    Runs of rows lying back to back in the file mapping are scanned
+    as a single range, the query never matches the line breaks
+    between them. Only reads the rows, so workers may run it
     */
-    editorScroll();
-
-    struct abuf ab = ABUF_INIT;
-    abufAppend(&ab, "\x1b[?25l", 6);
-    abufAppend(&ab, "\x1b[H", 3);
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    if (s->regex) {
+        searchRegexChunk(s, c);
+        return;
+    }
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-                                            (E.rx - E.coloff + 1));
-    abufAppend(&ab, buf, strlen(buf));
+    int at = c->start;
+    int stop = c->start + c->n;
+    erow *row = c->first;
+    while (at < stop) {
+        // Extend the range over the following rows of the mapping
+        erow *last = row;
+        int lastat = at;
+        const char *end = row->chars + row->size;
+        while (last->mapped && lastat + 1 < stop) {
+            erow *next = rowtreeNext(last);
+            if (!next->mapped) break;
+            if (next->chars - end < 1 || next->chars - end > 2) break;
+            last = next;
+            lastat++;
+            end = last->chars + last->size;
+        }
 
-    abufAppend(&ab, "\x1b[?25h", 6);
+        const char *p = row->chars;
+        while ((p = searchNext(s, p, end)) != NULL) {
+            while (p >= row->chars + row->size) {
+                row = rowtreeNext(row);
+                at++;
+            }
+            searchAdd(c, at, p - row->chars, s->qlen);
+            p += s->qlen;
+        }
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abufFree(&ab);
+        while (row != last) {
+            row = rowtreeNext(row);
+            at++;
+        }
+        row = rowtreeNext(row);
+        at++;
+    }
 }
 
-void editorSetStatusMessage(const char *fmt, ...) {
+void *searchWorker(void *arg) {
     /*
-    Sets the status message with a formatted string
+    Search worker thread, claims chunks of the current scan one
+    at a time and marks them done
     */
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-    va_end(ap);
-    E.statusmsg_time = time(NULL);
-}
-
-char *editorPrompt(char *prompt, void (*callback)(char *, int)) {
-    size_t bufsize = 128;
-    char *buf = malloc(bufsize);
-    size_t buflen = 0;
-    buf[0] = '\0';
+    struct editorSearch *s = arg;
 
+    pthread_mutex_lock(&s->lock);
     while (1) {
-        editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
+        while (s->next >= s->nchunks) pthread_cond_wait(&s->work, &s->lock);
 
-        int ch = editorReadKey();
-        if (ch == DEL_KEY || ch == CTRL_KEY('h') || ch == BACKSPACE) {
-            if (buflen != 0) buf[--buflen] = '\0';
-        } else if (ch == '\x1b') {
-            editorSetStatusMessage("");
-            if (callback) callback(buf, ch);
-            free(buf);
-            return NULL;
-        } else if (ch == '\r') {
-            if (buflen != 0) {
-                editorSetStatusMessage("");
-                if (callback) callback(buf, ch);
-                return buf;
-            }
-        } else if (!iscntrl(ch) && ch < 128) {
-            if (buflen == bufsize - 1) {
-                bufsize *= 2;
-                buf = realloc(buf, bufsize);
-            }
+        struct searchChunk *c = &s->chunks[s->next++];
+        s->busy++;
+        pthread_mutex_unlock(&s->lock);
 
-            buf[buflen++] = ch;
-            buf[buflen] = '\0';
-        }
+        searchScanChunk(s, c);
 
-        if (callback) callback(buf, ch);
+        pthread_mutex_lock(&s->lock);
+        c->done = 1;
+        s->busy--;
+        pthread_cond_broadcast(&s->done);
+        editorWake();
     }
+    return NULL;
 }
 
-void editorMoveCursor(int key) {
+void searchStartWorkers(struct editorSearch *s) {
     /*
-    Moves the cursor based on the key pressed,
-    e.g. arrow keys or wasd
+    Starts the worker pool, one thread per processor
     */
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-
-    switch (key) {
-        case ARROW_LEFT:
-            if (E.cx != 0) {
-                E.cx--;
-            } else if (E.cy > 0) {
-                E.cy--;
-                E.cx = E.row[E.cy].size;
-            }
-            break;
-        case ARROW_RIGHT:
-            if (row && E.cx < row->size) {
-                E.cx++;
-            } else if (row && E.cx == row->size) {
-                E.cy++;
-                E.cx = 0;
-            }
-            break;
-        case ARROW_UP:
-            if (E.cy != 0) E.cy--;
-            break;
-        case ARROW_DOWN:
-            if (E.cy < E.numrows) E.cy++;
-            break;
-    }
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) n = 1;
+    if (n > KAI_SEARCH_THREADS) n = KAI_SEARCH_THREADS;
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-    int rowlen = row ? row->size : 0;
-    if (E.cx > rowlen) {
-        E.cx = rowlen;
+    for (s->nworkers = 0; s->nworkers < n; s->nworkers++) {
+        if (pthread_create(&s->workers[s->nworkers], NULL, searchWorker, s) != 0)
+            die("pthread_create");
     }
 }
 
-char *editorRowsToString(int *buflen) {
+void searchCancel(struct editorSearch *s) {
     /*
-    Converts the editor rows to a single string
+    Stops the scan in progress, waits for the workers to finish
+    the chunks they hold and drops the chunks
     */
-    int totlen = 0;
-    int j;
+    pthread_mutex_lock(&s->lock);
+    s->next = s->nchunks;
+    while (s->busy) pthread_cond_wait(&s->done, &s->lock);
+
+    for (int j = 0; j < s->nchunks; j++) free(s->chunks[j].matches);
+    free(s->chunks);
+    s->chunks = NULL;
+    s->nchunks = s->nmerged = 0;
+    s->next = 0;
+    pthread_mutex_unlock(&s->lock);
+}
 
-    for (j = 0; j < E.numrows; j++) totlen += E.row[j].size + 1;
+void searchMerge(struct editorSearch *s) {
+    /*
+    Appends the next finished chunk's matches to the match set
+    */
+    struct searchChunk *c = &s->chunks[s->nmerged++];
+    if (c->count == 0) return;
 
-    *buflen = totlen;
-    char *buf = malloc(totlen);
-    char *p = buf;
-    for (j = 0; j < E.numrows; j++) {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+    if (s->count + c->count > s->cap) {
+        s->cap = s->count + c->count;
+        s->matches = realloc(s->matches, sizeof(struct searchMatch) * s->cap);
+        if (s->matches == NULL) die("realloc");
     }
+    memcpy(&s->matches[s->count], c->matches, sizeof(struct searchMatch) * c->count);
+    s->count += c->count;
 
-    return buf;
+    free(c->matches);
+    c->matches = NULL;
 }
 
-void editorOpen(char *filename) {
+int searchPoll(struct editorSearch *s) {
     /*
-    Opens a file and reads its contents into the editor
+    Merges the chunks finished so far in file order,
+    returns whether the match set grew
     */
-    free(E.filename);
-    E.filename = strdup(filename);
+    int merged = s->nmerged;
+    if (merged == s->nchunks) return 0;
 
-    editorSelectSyntaxHighlight();
-
-    FILE *fp = fopen(filename, "r");
-    if (!fp) die("fopen");
+    pthread_mutex_lock(&s->lock);
+    int ready = merged;
+    while (ready < s->nchunks && s->chunks[ready].done) ready++;
+    pthread_mutex_unlock(&s->lock);
 
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    while ((linelen = getline(&line, &linecap, fp)) != -1) {
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-            line[linelen - 1] == '\r'))
-            linelen--;
+    while (s->nmerged < ready) searchMerge(s);
+    return s->nmerged > merged;
+}
 
-        editorInsertRow(E.numrows, line, linelen);
+int searchHas(struct editorSearch *s, int j) {
+    /*
+    Returns whether the match set has a match j, waiting for
+    the workers only until it shows up or the scan ends
+    */
+    while (j >= s->count && s->nmerged < s->nchunks) {
+        pthread_mutex_lock(&s->lock);
+        while (!s->chunks[s->nmerged].done) pthread_cond_wait(&s->done, &s->lock);
+        pthread_mutex_unlock(&s->lock);
+        searchPoll(s);
     }
-
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    return j < s->count;
 }
 
-void editorSave() {
+void searchScan(struct editorSearch *s, int from) {
     /*
-    General save function, saves current open file
-    or prompts the user to save as a new file
+    Collects every match of the query in the rows from row from on,
+    behind the matches of the rows before it. Big files are split
+    into chunks of whole tree leaves and scanned by the worker pool,
+    the matches are merged back in file order as the chunks finish.
+    Small files are scanned right away
     */
-    if (E.filename == NULL) {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL) {
-            editorSetStatusMessage("Save aborted");
-            return;
+    if (from == 0) s->count = 0;
+    s->scanned = E.numrows;
+    if (from >= E.numrows || (s->regex && s->prog == NULL)) return;
+
+    int n = (E.numrows - from + KAI_SEARCH_CHUNK - 1) / KAI_SEARCH_CHUNK + 1;
+    struct searchChunk *chunks = calloc(n, sizeof(struct searchChunk));
+    if (chunks == NULL) die("calloc");
+
+    n = 0;
+    erow *first = editorRowAt(from);
+    struct rownode *leaf = first->leaf;
+    for (int at = from; leaf; leaf = leaf->next) {
+        // The first leaf is only scanned from the row given on
+        int skip = (leaf == first->leaf) ? first - leaf->rows : 0;
+        if (leaf->n - skip <= 0) continue;
+
+        struct searchChunk *c = &chunks[n];
+        if (c->first == NULL) {
+            c->first = leaf->rows + skip;
+            c->start = at;
         }
+        c->n += leaf->n - skip;
+        at += leaf->n - skip;
+        if (c->n >= KAI_SEARCH_CHUNK && leaf->next) n++;
+    }
+    if (chunks[n].n) n++;
 
-        editorSelectSyntaxHighlight();
+    if (n == 1) {
+        searchScanChunk(s, &chunks[0]);
+        chunks[0].done = 1;
+    } else if (s->nworkers == 0) {
+        searchStartWorkers(s);
     }
 
-    int len;
-    char *buf = editorRowsToString(&len);
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-
-    if (fd != -1) {
-        if (ftruncate(fd, len) != -1) {
-            if (write(fd, buf, len) == len) {
-                close(fd);
-                free(buf);
-                editorSetStatusMessage("%d bytes written to disk", len);
-                E.dirty = 0;
-                return;
-            }
+    pthread_mutex_lock(&s->lock);
+    s->chunks = chunks;
+    s->nchunks = n;
+    s->next = (n == 1) ? 1 : 0;
+    pthread_cond_broadcast(&s->work);
+    pthread_mutex_unlock(&s->lock);
+
+    searchPoll(s);
+}
+
+void searchNarrow(struct editorSearch *s) {
+    /*
+    Drops the matches that the grown query no longer matches,
+    every match of a query starts at a match of its prefixes.
+    Runs once the scan of the shorter query is complete
+    */
+    int n = 0;
+    int at = 0;
+    erow *row = editorRowAt(0);
+    for (int j = 0; j < s->count; j++) {
+        struct searchMatch *m = &s->matches[j];
+        if (m->row - at > 64) {
+            row = editorRowAt(m->row);
+            at = m->row;
+        }
+        while (at < m->row) {
+            row = rowtreeNext(row);
+            at++;
+        }
+
+        if (row->size - m->col >= s->qlen &&
+            memcmp(&row->chars[m->col], s->query, s->qlen) == 0) {
+            m->len = s->qlen;
+            s->matches[n++] = *m;
         }
-        close(fd);
     }
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    s->count = n;
+}
+
+int searchBusy(struct editorSearch *s) {
+    /*
+    Returns whether a scan is running, the workers walk the row tree
+    so rows are neither added nor removed until it ends
+    */
+    return s->nmerged < s->nchunks;
+}
+
+int searchTail(struct editorSearch *s) {
+    /*
+    Scans the rows added behind the match set since its scan, once
+    no scan is running. Returns whether it started one
+    */
+    if (s->query == NULL || searchBusy(s) || s->scanned >= E.numrows) return 0;
+    searchCancel(s);
+    searchScan(s, s->scanned);
+    return 1;
+}
+
+void searchDropFrom(struct editorSearch *s, int at) {
+    /*
+    Drops the matches from row at on, before those rows are deleted
+    to be read in again
+    */
+    while (s->count > 0 && s->matches[s->count - 1].row >= at) s->count--;
+    if (s->current >= s->count) s->current = s->count - 1;
+    if (s->scanned > at) s->scanned = at;
+}
+
+void searchUpdate(struct editorSearch *s, char *query) {
+    /*
+    Brings the match set up to date with the query typed so far
+    */
+    int narrow = !s->regex && s->query && s->qlen > 0 && s->nmerged == s->nchunks &&
+        strncmp(query, s->query, s->qlen) == 0;
+
+    searchCancel(s);
+    searchCompile(s, query);
+    if (narrow) searchNarrow(s);
+    else searchScan(s, 0);
+}
+
+void searchFree(struct editorSearch *s) {
+    /*
+    Ends a search and releases its match set
+    */
+    searchCancel(s);
+    regexFree(s->prog);
+    s->prog = NULL;
+    free(s->query);
+    free(s->matches);
+    s->query = NULL;
+    s->matches = NULL;
+    s->qlen = s->count = s->cap = s->scanned = 0;
+    s->current = -1;
 }
 
 void editorFindCallback(char *query, int key) {
-    static int last_match = -1;
-    static int direction = 1;
+    struct editorSearch *s = &E.search;
 
-    static int saved_hl_line;
-    static unsigned char *saved_hl = NULL;
+    static int saved_hl_line, saved_hl_long;
+    static int saved_hl_off, saved_hl_len;
+    static uint16_t *saved_hl = NULL, *match_hl = NULL;
 
     if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
+        // The runs of the row are swapped back in unless a long row
+        // whose window moved has been highlighted afresh, or the row
+        // went away with the rows a followed file was read into
+        erow *row = editorRowAt(saved_hl_line);
+        if (row && row->hl == match_hl && row->rsize == saved_hl_len &&
+            (row->lr ? row->lr->roff : 0) == saved_hl_off) {
+            editorRowFreeHl(row, row->hl);
+            row->hl = saved_hl;
+        } else {
+            editorHlFree(saved_hl, saved_hl_long);
+        }
         saved_hl = NULL;
     }
 
     if (key == '\r' || key == '\x1b') {
-        last_match = -1;
-        direction = 1;
+        searchFree(s);
         return;
-    } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-        direction = 1;
-    } else if (key == ARROW_LEFT || key == ARROW_UP) {
-        direction = -1;
-    } else {
-        last_match = -1;
-        direction = 1;
     }
 
-    if (last_match == -1) direction = 1;
-
-    int current = last_match;
-    for (int i = 0; i < E.numrows; i++) {
-        current += direction;
-        if (current == -1) current = E.numrows - 1;
-        else if (current == E.numrows) current = 0;
+    int j = s->current;
+    if (s->query && s->current != -1 &&
+        (key == ARROW_RIGHT || key == ARROW_DOWN)) {
+        // First match on the next row that has any
+        int line = s->matches[j].row;
+        while (searchHas(s, j) && s->matches[j].row == line) j++;
+        if (!searchHas(s, j)) j = 0;
+    } else if (s->query && s->current != -1 &&
+        (key == ARROW_LEFT || key == ARROW_UP)) {
+        // First match on the previous row that has any
+        int line = s->matches[j].row;
+        while (j > 0 && s->matches[j - 1].row == line) j--;
+        if (j == 0) searchHas(s, INT_MAX);
+        j = (j == 0) ? s->count - 1 : j - 1;
+        while (j > 0 && s->matches[j - 1].row == s->matches[j].row) j--;
+    } else {
+        if (s->query == NULL || strcmp(query, s->query) != 0)
+            searchUpdate(s, query);
+        j = 0;
+    }
 
-        erow *row = &E.row[current];
-        char *match = strstr(row->render, query);
+    if (!searchHas(s, j)) {
+        s->current = -1;
+        return;
+    }
 
-        if (match) {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
+    s->current = j;
+    struct searchMatch *m = &s->matches[j];
+    erow *row = editorRowAt(m->row);
 
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
-        }
-    }
+    editorSyntaxAdvance(m->row + 1);
+    editorRowPrepare(row);
+    E.cy = m->row;
+    E.cx = m->col;
+    E.rowoff = E.numrows;
+    editorScroll();
+    editorRowWindow(row);
+
+    int roff = row->lr ? row->lr->roff : 0;
+    int rx = editorRowCxToRx(row, m->col) - roff;
+    int rend = editorRowCxToRx(row, m->col + m->len) - roff;
+    if (rx < 0) rx = 0;
+    if (rend > row->rsize) rend = row->rsize;
+    saved_hl_line = m->row;
+    saved_hl_long = row->lr != NULL;
+    saved_hl_off = roff;
+    saved_hl_len = row->rsize;
+    saved_hl = row->hl;
+
+    // The match is painted over a decoded copy that gets runs of its own
+    unsigned char *hl = editorHlScratch(row->rsize);
+    memset(hl, HL_NORMAL, row->rsize);
+    if (saved_hl) editorHlDecode(saved_hl, hl);
+    if (rend > rx) memset(&hl[rx], HL_MATCH, rend - rx);
+    row->hl = NULL;
+    editorRowSetHl(row, hl, row->rsize);
+    match_hl = row->hl;
 }
 
-void editorFind() {
+void editorFind(int regex) {
     int saved_cx = E.cx;
     int saved_cy = E.cy;
     int saved_coloff = E.coloff;
     int saved_rowoff = E.rowoff;
 
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
+    editorCloseGap();
+    E.search.regex = regex;
+    char *query = editorPrompt(regex ? "Regex: %s (Use ESC/Arrows/Enter)" :
+                             "Search: %s (Use ESC/Arrows/Enter)",
                              editorFindCallback);
 
     if (query) {
@@ -1034,19 +5758,41 @@ void editorProcessKeypress() {
     Processes a keypress from the user
     */
     static int quit_times = KAI_QUIT_TIMES; 
+    static int close_times = 1;
+    static int last_run = 0;
     int ch = editorReadKey();
+    E.stats.key_ns = editorStatsSince(E.stats.key_start);
+    editorTraceSpan("key", E.stats.key_start, E.stats.key_ns);
+    E.stats.edit_start = editorStatsClock();
+
+    // A run of typed chars or of backspaces is undone as one step
+    int run = (ch == BACKSPACE || ch == CTRL_KEY('h')) ? 2 :
+              (ch == '\t' || (ch < 256 && !iscntrl((unsigned char)ch))) ? 1 : 0;
+    if (run == 0 || run != last_run) editorUndoBreak();
+    last_run = run;
+
     switch (ch) {
         case '\r':
             editorInsertNewline();
             break;
         case CTRL_KEY('q'):
-            if (E.dirty && quit_times > 0) {
+            if (E.views[E.view].buf->stream) {
+                editorStreamFinish(E.views[E.view].buf, 1);
+                editorSetStatusMessage("Loading cancelled at %d lines", E.numrows);
+                return;
+            }
+            if (editorAnyDirty() && quit_times > 0) {
                 editorSetStatusMessage("WARNING!!! File has unsaved changes. "
                     "Press Ctrl-Q %d more times to quit.", quit_times);
 
                 quit_times--;
                 return;
             }
+            editorSaveWait();
+            for (int j = 0; j < E.nviews; j++) {
+                editorSwitchView(j);
+                editorSwapUnlink();
+            }
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -1054,14 +5800,49 @@ void editorProcessKeypress() {
         case CTRL_KEY('s'):
             editorSave();
             break;
+        case CTRL_KEY('o'):
+            {
+                char *name = editorPrompt("Open: %s (ESC to cancel)", NULL);
+                if (name) editorOpenBuffer(name);
+                free(name);
+            }
+            break;
+        case CTRL_KEY('b'):
+            editorSwitchView((E.view + 1) % E.nviews);
+            break;
+        case CTRL_KEY('t'):
+            editorFollowToggle();
+            break;
+        case CTRL_KEY('p'):
+            E.stats.overlay = !E.stats.overlay;
+            break;
+        case CTRL_KEY('w'):
+            if (E.dirty && E.views[E.view].buf->nviews == 1 && close_times > 0) {
+                editorSetStatusMessage("WARNING!!! Buffer has unsaved changes. "
+                    "Press Ctrl-W again to close it.");
+
+                close_times--;
+                return;
+            }
+            editorCloseView();
+            break;
+        case CTRL_KEY('z'):
+            editorUndo();
+            break;
+        case CTRL_KEY('y'):
+            editorRedo();
+            break;
         case HOME_KEY:
             E.cx = 0;
             break;
         case END_KEY:
-            if (E.cy < E.numrows) E.cx = E.row[E.cy].size;
+            if (E.cy < E.numrows) E.cx = editorRowAt(E.cy)->size;
             break;
         case CTRL_KEY('f'):
-            editorFind();
+            editorFind(0);
+            break;
+        case CTRL_KEY('r'):
+            editorFind(1);
             break;
         case BACKSPACE:
         case CTRL_KEY('h'):
@@ -1091,6 +5872,16 @@ void editorProcessKeypress() {
             editorMoveCursor(ch);
             break;
         case CTRL_KEY('l'):
+            E.shadow.rows = 0;
+            break;
+        case PASTE_START:
+            {
+                struct abuf ab = ABUF_INIT;
+                editorReadPaste(&ab);
+                if (ab.len) editorInsertText(ab.b, ab.len);
+                abufFree(&ab);
+            }
+            break;
         case '\x1b':
             break;
         default:
@@ -1099,6 +5890,7 @@ void editorProcessKeypress() {
     }
 
     quit_times = KAI_QUIT_TIMES;
+    close_times = 1;
 }
 
 void initEditor() {
@@ -1108,13 +5900,44 @@ void initEditor() {
     E.cx = 0, E.cy = 0;
     E.rx = 0;
     E.rowoff = 0, E.coloff = 0;
-    E.numrows = 0;
-    E.row = NULL;
-    E.dirty = 0;
-    E.filename = NULL;
+    E.views = NULL;
+    E.nviews = 0;
+    E.view = editorAddView(editorBufferNew());
+    editorViewLoad();
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
-    E.syntax = NULL;
+    E.search.current = -1;
+    E.save = NULL;
+    E.save_gen = 0;
+    char *autosave = getenv("KAI_AUTOSAVE");
+    E.autosave = autosave ? atoi(autosave) : 0;
+    E.autosave_time = time(NULL);
+    pthread_mutex_init(&E.search.lock, NULL);
+    pthread_cond_init(&E.search.work, NULL);
+    pthread_cond_init(&E.search.done, NULL);
+    E.inlen = E.inpos = 0;
+    E.inotifyfd = -1;
+    E.rxcache.size = -1;
+    editorInitColors();
+
+    // Frame timings are logged for as long as the editor runs
+    char *trace = getenv("KAI_TRACE");
+    E.stats.trace = trace ? fopen(trace, "w") : NULL;
+    if (trace && E.stats.trace == NULL) die("fopen");
+    if (E.stats.trace) fputs("[\n", E.stats.trace);
+
+    if (pipe2(E.wakefd, O_NONBLOCK | O_CLOEXEC) == -1) die("pipe");
+}
+
+void editorInitWindow() {
+    /*
+    Gets the size of the terminal and repaints when it changes
+    */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorHandleWinch;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGWINCH, &sa, NULL) == -1) die("sigaction");
 
     if (getWindowSize(&E.screenrows, &E.screencols) == -1)
         die("getWindowSize");
@@ -1122,23 +5945,44 @@ void initEditor() {
     E.screenrows -= 2;
 }
 
+#ifndef KAI_BENCH
 int main(int argc, char *argv[]) {
     /*
     Start point
     */
+    int input = -1;
+    for (int j = 1; j < argc; j++)
+        if (!strcmp(argv[j], "-") && input == -1) input = editorTakeStdin();
     enableRawMode();
     initEditor();
-    if (argc >= 2) {
-        editorOpen(argv[1]);
+    editorInitWindow();
+    int follow = 0;
+    for (int j = 1; j < argc; j++) {
+        if (!strcmp(argv[j], "-f")) {
+            follow = 1;
+            continue;
+        }
+        if (!strcmp(argv[j], "-")) {
+            if (input != -1) editorOpenStream(input);
+            input = -1;
+            continue;
+        }
+        if (editorOpenBuffer(argv[j]) == 0 && follow) editorFollowStart();
     }
+    editorSwitchView(0);
 
     editorSetStatusMessage(
-        "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+        "HELP: ^S save | ^Q quit | ^F find | ^R regex | ^Z/^Y undo | ^O open | ^B/^W buf");
 
     while (1) {
-        editorRefreshScreen();
+        editorSavePoll();
+        // Keys already read in are handled before repainting
+        if (!editorKeyPending()) editorRefreshScreen();
         editorProcessKeypress();
+        E.stats.edit_ns = editorStatsSince(E.stats.edit_start);
+        editorTraceSpan("edit", E.stats.edit_start, E.stats.edit_ns);
     }
 
     return 0;
 }
+#endif
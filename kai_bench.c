@@ -0,0 +1,270 @@
+/*
+Drives the editor core without a terminal and times its hot paths:
+opening a file, highlighting it, building frames, searching, editing
+and saving. With no arguments it runs on synthetic corpora, otherwise
+on the files given
+*/
+#define KAI_BENCH
+#include "kai.c"
+
+#define BENCH_ROWS 48
+#define BENCH_COLS 200
+#define BENCH_FRAMES 2000
+#define BENCH_KEYS 2000
+#define BENCH_NEXT 200
+#define BENCH_QUERY "return"
+
+struct benchSamples {
+    // Latencies of one benchmark in nanoseconds
+    long long *ns;
+    int n;
+    int cap;
+};
+
+long long benchNow() {
+    /*
+    Returns a monotonic time in nanoseconds
+    */
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void benchAdd(struct benchSamples *s, long long ns) {
+    /*
+    Records one latency
+    */
+    if (s->n == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->ns = realloc(s->ns, sizeof(long long) * s->cap);
+        if (s->ns == NULL) die("realloc");
+    }
+    s->ns[s->n++] = ns;
+}
+
+int benchCompare(const void *a, const void *b) {
+    /*
+    Orders latencies for qsort
+    */
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+void benchReport(const char *name, struct benchSamples *s) {
+    /*
+    Prints the count, p50 and p99 of the latencies and forgets them
+    */
+    if (s->n == 0) return;
+    qsort(s->ns, s->n, sizeof(long long), benchCompare);
+    printf("  %-12s %8d ops  p50 %9.1f us  p99 %9.1f us\n", name, s->n,
+        s->ns[s->n / 2] / 1e3, s->ns[(int)(s->n * 0.99)] / 1e3);
+    s->n = 0;
+}
+
+void benchThroughput(const char *name, long long ns, long long bytes) {
+    /*
+    Prints the time a pass over the whole buffer took
+    */
+    printf("  %-12s %8.1f ms  %8.1f MB/s\n", name, ns / 1e6,
+        ns ? bytes / 1048576.0 / (ns / 1e9) : 0);
+}
+
+double benchRss() {
+    /*
+    Returns the resident set size in megabytes
+    */
+    long pages = 0, resident = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == NULL) return 0;
+    if (fscanf(fp, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(fp);
+    return resident * (double)sysconf(_SC_PAGESIZE) / 1048576.0;
+}
+
+void benchFrame() {
+    /*
+    Builds a frame like editorRefreshScreen does, the escape
+    sequences are made but not written anywhere
+    */
+    static struct abuf ab = ABUF_INIT;
+    editorScroll();
+    struct screenFrame *f = &E.frame;
+    frameResize(f, E.screenrows + 2, E.screencols);
+    f->rowoff = E.rowoff;
+    f->coloff = E.coloff;
+    editorDrawRows(f);
+    editorDrawStatusBar(f);
+    editorDrawMessageBar(f);
+    ab.len = 0;
+    frameFlush(&ab, f, &E.shadow);
+}
+
+unsigned benchRand() {
+    /*
+    Returns the next number of a fixed sequence, so that every run
+    edits the same places
+    */
+    static unsigned seed = 12345;
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+void benchWriteCorpus(char *path, int kind) {
+    /*
+    Writes a synthetic corpus: 0 is a million rows of C, 1 is C
+    that is mostly block comments, 2 is a few very long rows
+    */
+    static const char *code[] = {
+        "int main(int argc, char **argv) {",
+        "\tfor (int j = 0; j < argc; j++) printf(\"%s\\n\", argv[j]);",
+        "\tif (x == 0x1f && y != 3.25) return -1; // done",
+        "\tchar *s = \"a string with /* no comment */ in it\";",
+        "\treturn editorRowAt(E.cy)->size + 'c';",
+        "}",
+        "",
+    };
+    int ncode = sizeof(code) / sizeof(code[0]);
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) die("fopen");
+
+    if (kind == 0) {
+        for (int j = 0; j < 1000000; j++) fprintf(fp, "%s\n", code[j % ncode]);
+    } else if (kind == 1) {
+        for (int j = 0; j < 300000; j++) {
+            if (j % 20 == 0) fprintf(fp, "/*\n");
+            else if (j % 20 == 15) fprintf(fp, " */\n");
+            else if (j % 20 < 15) fprintf(fp, " * comment %d with \"quotes\" and\ttabs\n", j);
+            else fprintf(fp, "%s\n", code[j % ncode]);
+        }
+    } else {
+        for (int j = 0; j < 16; j++) {
+            for (int k = 0; k < 20000; k++)
+                fprintf(fp, "%s ", code[(j + k) % ncode]);
+            fprintf(fp, "\n");
+        }
+    }
+    if (fclose(fp) == EOF) die("fclose");
+}
+
+void benchFile(char *path) {
+    /*
+    Runs every benchmark on one file in a view of its own, which is
+    closed afterwards
+    */
+    struct benchSamples s = { NULL, 0, 0 };
+    double rss = benchRss();
+
+    long long t = benchNow();
+    if (editorOpenBuffer(path) == -1) {
+        printf("%s: %s\n", path, E.statusmsg);
+        return;
+    }
+    editorStreamFinish(E.views[E.view].buf, 0);
+    long long open = benchNow() - t;
+    long long bytes = 0;
+    for (erow *row = editorRowAt(0); row; row = rowtreeNext(row))
+        bytes += row->size + 1;
+
+    printf("%s: %.1f MB, %d rows\n", path, bytes / 1048576.0, E.numrows);
+    benchThroughput("open", open, bytes);
+    printf("  %-12s %8.1f MB\n", "rss", benchRss() - rss);
+
+    // The frontier is moved the way the idle loop does it
+    if (E.syntax) {
+        t = benchNow();
+        while (E.hl_frontier < E.numrows) {
+            long long slice = benchNow();
+            editorSyntaxSlice();
+            benchAdd(&s, benchNow() - slice);
+        }
+        benchThroughput("syntax", benchNow() - t, bytes);
+        benchReport("syntax slice", &s);
+    }
+
+    // Frames all over the file, every one drawn afresh
+    for (int j = 0; j < BENCH_FRAMES && E.numrows; j++) {
+        E.cy = (long long)E.numrows * j / BENCH_FRAMES;
+        E.cx = 0;
+        t = benchNow();
+        benchFrame();
+        benchAdd(&s, benchNow() - t);
+    }
+    benchReport("draw", &s);
+
+    // Incremental search one typed char at a time, then the next matches
+    char query[sizeof(BENCH_QUERY)];
+    for (int j = 1; j < (int)sizeof(BENCH_QUERY); j++) {
+        memcpy(query, BENCH_QUERY, j);
+        query[j] = '\0';
+        t = benchNow();
+        editorFindCallback(query, query[j - 1]);
+        benchFrame();
+        benchAdd(&s, benchNow() - t);
+    }
+    benchReport("find type", &s);
+    for (int j = 0; j < BENCH_NEXT; j++) {
+        t = benchNow();
+        editorFindCallback(query, ARROW_DOWN);
+        benchFrame();
+        benchAdd(&s, benchNow() - t);
+    }
+    benchReport("find next", &s);
+    editorFindCallback(query, '\r');
+
+    // Typing and deleting at random places, each followed by a frame
+    for (int j = 0; j < BENCH_KEYS && E.numrows; j++) {
+        E.cy = benchRand() % E.numrows;
+        erow *row = editorRowAt(E.cy);
+        E.cx = row->size ? benchRand() % (row->size + 1) : 0;
+        t = benchNow();
+        if (j % 4 == 3 && E.cx > 0) editorDelChar();
+        else editorInsertChar('a' + j % 26);
+        benchFrame();
+        benchAdd(&s, benchNow() - t);
+    }
+    benchReport("keystroke", &s);
+
+    char *out = malloc(strlen(path) + 7);
+    if (out == NULL) die("malloc");
+    sprintf(out, "%s.bench", path);
+    t = benchNow();
+    editorSaveStart(strdup(out), 0);
+    editorSaveWait();
+    benchThroughput("save", benchNow() - t, bytes);
+    unlink(out);
+    free(out);
+    free(s.ns);
+
+    // An empty view is left for the next file to reuse
+    int view = E.view;
+    editorSwitchView(editorAddView(editorBufferNew()));
+    editorSwitchView(view);
+    editorCloseView();
+}
+
+int main(int argc, char *argv[]) {
+    /*
+    Start point
+    */
+    initEditor();
+    E.screenrows = BENCH_ROWS;
+    E.screencols = BENCH_COLS;
+
+    if (argc > 1) {
+        for (int j = 1; j < argc; j++) benchFile(argv[j]);
+        return 0;
+    }
+
+    char dir[] = "/tmp/kai_bench.XXXXXX";
+    if (mkdtemp(dir) == NULL) die("mkdtemp");
+    static const char *names[] = { "lines.c", "comments.c", "long.c" };
+    for (int j = 0; j < 3; j++) {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/%s", dir, names[j]);
+        benchWriteCorpus(path, j);
+        benchFile(path);
+        unlink(path);
+    }
+    rmdir(dir);
+    return 0;
+}